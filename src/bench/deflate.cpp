@@ -0,0 +1,162 @@
+#include "pch.hpp"
+#include "common/compression.hpp"
+#include "common/message.hpp"
+#include "common/response_datamodel.hpp"
+#include <boost/beast/zlib.hpp>
+#include <ctime>
+#include <iomanip>
+#include <random>
+
+// Bytes against CPU of the permessage-deflate settings: compresses the frames a session sends,
+// live NewMessage frames and RoomHistory pages, the way Beast does per message. With context
+// takeover the stream keeps its window across messages, without it the stream is reset per message.
+
+std::vector<std::string> makeFrames( size_t messages, size_t pageSize )
+{
+    static constexpr std::array Words{ "the",     "meeting", "is",      "moved", "to",     "tomorrow", "at",   "noon",
+                                       "can",     "you",     "review",  "my",    "change", "please",   "ok",   "thanks",
+                                       "deploy",  "failed",  "again",   "on",    "the",    "staging",  "lgtm", "ship",
+                                       "it",      "lunch",   "anyone",  "build", "is",     "green",    "now",  "?" };
+    std::mt19937 random( 1 );
+    std::uniform_int_distribution<size_t> word( 0, Words.size() - 1 );
+    std::uniform_int_distribution<size_t> length( 2, 24 );
+    std::uniform_int_distribution<size_t> sender( 0, 19 );
+
+    std::vector<ChatMessage> history;
+    for ( size_t i = 0; i < messages; ++i )
+    {
+        ChatMessage message{ .seq = i + 1,
+                             .sender = "user" + std::to_string( sender( random ) ),
+                             .content = {},
+                             .timestamp = 1'700'000'000'000 + static_cast<int64_t>( i ) * 1500 };
+        for ( size_t n = length( random ); n; --n )
+            message.content += std::string( Words[word( random )] ) + ( n > 1 ? " " : "" );
+        history.push_back( std::move( message ) );
+    }
+
+    // Every message on its own, then the same history again as pages, as a reconnecting client gets it
+    std::vector<std::string> frames;
+    for ( const auto& message : history )
+        frames.push_back( makeMessage( ServerMessageType::NewMessage, NewMessage{ .room = "general", .chatMessage = message } ) );
+    for ( size_t i = 0; i < history.size(); i += pageSize )
+    {
+        HistoryPage page{ .room = "general", .cursor = history[i].seq };
+        page.messages.assign( history.begin() + static_cast<ptrdiff_t>( i ),
+                              history.begin() + static_cast<ptrdiff_t>( std::min( i + pageSize, history.size() ) ) );
+        frames.push_back( makeMessage( ServerMessageType::RoomHistory, page ) );
+    }
+    return frames;
+}
+
+struct DeflateResult
+{
+    size_t rawBytes = 0;
+    size_t sentBytes = 0;
+    double cpuSeconds = 0;
+};
+
+DeflateResult deflate( const std::vector<std::string>& frames, const CompressionOptions& options )
+{
+    beast::zlib::deflate_stream stream;
+    stream.reset( options.compressionLevel, options.windowBits, options.memLevel, beast::zlib::Strategy::normal );
+    std::vector<unsigned char> out;
+
+    DeflateResult result;
+    const auto start = std::clock();
+    for ( const auto& frame : frames )
+    {
+        result.rawBytes += frame.size();
+        if ( frame.size() < options.minSize )
+        {
+            result.sentBytes += frame.size();
+            continue;
+        }
+        if ( options.noContextTakeover )
+            stream.reset();
+
+        out.resize( frame.size() + 64 );
+        beast::zlib::z_params params;
+        params.next_in = frame.data();
+        params.avail_in = frame.size();
+        params.next_out = out.data();
+        params.avail_out = out.size();
+        beast::error_code error;
+        stream.write( params, beast::zlib::Flush::sync, error );
+        if ( error or params.avail_in )
+            throw std::runtime_error( "Deflate failed: " + error.message() );
+        // Like Beast, the empty block ending a sync flush is not sent
+        result.sentBytes += out.size() - params.avail_out - 4;
+    }
+    result.cpuSeconds = static_cast<double>( std::clock() - start ) / CLOCKS_PER_SEC;
+    return result;
+}
+
+int main( int argc, char* argv[] )
+{
+    size_t messages = 0;
+    size_t pageSize = 0;
+    size_t minSize = 0;
+    std::vector<int> windowBits;
+    std::vector<int> memLevels;
+    std::vector<int> levels;
+
+    po::options_description description( "permessage-deflate bytes against CPU benchmark" );
+    description.add_options()
+        ( "help,h", "Show this help" )
+        ( "messages", po::value( &messages )->default_value( 20'000 ), "Chat messages sent live and again as history pages" )
+        ( "page-size", po::value( &pageSize )->default_value( 50 ), "Messages per RoomHistory page" )
+        ( "min-size", po::value( &minSize )->default_value( CompressionOptions{}.minSize ), "Frames below this size are sent uncompressed" )
+        ( "window-bits", po::value( &windowBits )->multitoken()->default_value( { 9, 12, 15 }, "9 12 15" ), "Window bits to compare" )
+        ( "mem-level", po::value( &memLevels )->multitoken()->default_value( { 1, 4, 8 }, "1 4 8" ), "Memory levels to compare" )
+        ( "level", po::value( &levels )->multitoken()->default_value( { 1, 6, 9 }, "1 6 9" ), "Compression levels to compare" );
+
+    try
+    {
+        po::variables_map variables;
+        po::store( po::parse_command_line( argc, argv, description ), variables );
+        po::notify( variables );
+        if ( variables.count( "help" ) )
+        {
+            std::cout << description << "\n";
+            return 0;
+        }
+        if ( not messages or not pageSize )
+            throw po::error( "--messages and --page-size must not be 0" );
+        for ( const int bits : windowBits )
+            if ( bits < 9 or bits > 15 )
+                throw po::error( "--window-bits must be in 9..15" );
+        for ( const int memLevel : memLevels )
+            if ( memLevel < 1 or memLevel > 9 )
+                throw po::error( "--mem-level must be in 1..9" );
+        for ( const int level : levels )
+            if ( level < 0 or level > 9 )
+                throw po::error( "--level must be in 0..9" );
+    }
+    catch ( const po::error& e )
+    {
+        std::cerr << "Error: " << e.what() << "\n" << description << "\n";
+        return 1;
+    }
+
+    const auto frames = makeFrames( messages, pageSize );
+    std::cout << frames.size() << " frames, frames below " << minSize << " bytes are sent uncompressed\n";
+    std::cout << std::setw( 6 ) << "bits" << std::setw( 6 ) << "mem" << std::setw( 7 ) << "level" << std::setw( 10 ) << "takeover"
+              << std::setw( 14 ) << "raw bytes" << std::setw( 14 ) << "sent bytes" << std::setw( 8 ) << "ratio" << std::setw( 10 ) << "cpu ms"
+              << std::setw( 10 ) << "MB/s" << "\n";
+    for ( const int bits : windowBits )
+        for ( const int memLevel : memLevels )
+            for ( const int level : levels )
+                for ( const bool noContextTakeover : { false, true } )
+                {
+                    const CompressionOptions options{ .windowBits = bits, .memLevel = memLevel, .compressionLevel = level,
+                                                      .minSize = minSize, .noContextTakeover = noContextTakeover };
+                    const auto result = deflate( frames, options );
+                    std::cout << std::setw( 6 ) << bits << std::setw( 6 ) << memLevel << std::setw( 7 ) << level << std::setw( 10 )
+                              << ( noContextTakeover ? "no" : "yes" ) << std::setw( 14 ) << result.rawBytes << std::setw( 14 )
+                              << result.sentBytes << std::setw( 8 ) << std::fixed << std::setprecision( 2 )
+                              << static_cast<double>( result.sentBytes ) / static_cast<double>( result.rawBytes ) << std::setw( 10 )
+                              << std::setprecision( 1 ) << result.cpuSeconds * 1000 << std::setw( 10 )
+                              << static_cast<double>( result.rawBytes ) / 1e6 / std::max( result.cpuSeconds, 1e-9 ) << "\n";
+                }
+    return 0;
+}
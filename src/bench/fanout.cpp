@@ -0,0 +1,192 @@
+#include "pch.hpp"
+#include "load_client.hpp"
+#include "server/database.hpp"
+#include "server/server.hpp"
+#include "server/server_controllers.hpp"
+#include <future>
+#include <iomanip>
+
+// Socket writes per delivered message during a broadcast burst: receivers join one room of an
+// in-process server and a poster sends a burst into it. Compares writing every frame on its own
+// (--max-coalesced-bytes 0) with gathering a session's queued frames into one write.
+
+struct FanoutOptions
+{
+    int port = 0;
+    int threads = 0;
+    size_t receivers = 0;
+    size_t messages = 0;
+    BatchOptions batch;
+};
+
+struct FanoutResult
+{
+    uint64_t delivered = 0;
+    uint64_t frames = 0;
+    uint64_t socketWrites = 0;
+    double seconds = 0;
+};
+
+awaitable<void> receive( tcp::endpoint endpoint, size_t messages, std::atomic<size_t>& joined, std::atomic<size_t>& running,
+                         std::atomic<uint64_t>& delivered )
+{
+    LoadClient client( co_await asio::this_coro::executor );
+    co_await client.connect( endpoint );
+    const JoinRoomRequest request{ .room = "bench" };
+    co_await client.send( ClientMessageType::JoinRoom, request );
+    while ( co_await client.read() != "RoomHistory" )
+        ;
+    ++joined;
+
+    size_t received = 0;
+    while ( received < messages )
+    {
+        const auto type = co_await client.read();
+        if ( type == "NewMessage" )
+            ++received;
+        else if ( type == "NewMessages" )
+            received += client.data<NewMessages>().chatMessages.size();
+    }
+    delivered += received;
+    --running;
+    co_await client.close();
+}
+
+awaitable<void> post( tcp::endpoint endpoint, size_t messages, size_t receivers, const std::atomic<size_t>& joined,
+                      std::function<void()> start )
+{
+    LoadClient client( co_await asio::this_coro::executor );
+    co_await client.connect( endpoint );
+
+    asio::steady_timer timer( co_await asio::this_coro::executor );
+    while ( joined < receivers )
+    {
+        timer.expires_after( std::chrono::milliseconds( 1 ) );
+        co_await timer.async_wait( asio::use_awaitable );
+    }
+
+    start();
+    for ( size_t i = 0; i < messages; ++i )
+    {
+        const PostMessageRequest request{ .user = "poster", .room = "bench", .message = "burst message " + std::to_string( i ) };
+        co_await client.send( ClientMessageType::PostMessage, request );
+    }
+    co_await client.close();
+}
+
+FanoutResult run( const FanoutOptions& options, size_t maxCoalescedBytes )
+{
+    Server server( "127.0.0.1", options.port, options.threads );
+    // The queues have to hold the whole burst, a dropped frame would leave a receiver waiting
+    server.setSessionOptions( SessionOptions{ .maxQueuedMessages = options.messages + 64,
+                                              .maxQueuedBytes = SIZE_MAX,
+                                              .maxCoalescedBytes = maxCoalescedBytes } );
+    server.setCompressionOptions( CompressionOptions{ .enabled = false } );
+
+    auto& ioContext = server.getIOContext();
+    const auto shards = static_cast<size_t>( options.threads );
+    Database database( ioContext, {}, {}, {}, shards );
+    MessageBatcher batcher( server, options.batch, shards );
+    server.addController( ClientMessageType::JoinRoom, OnJoinRoomController( server, database, HistoryOptions{} ) );
+    server.addController( ClientMessageType::PostMessage, OnNewMessageController( batcher, database ) );
+
+    const std::string room = "bench";
+    std::promise<void> ready;
+    asio::co_spawn( ioContext, database.addRoom( room ), [&]( std::exception_ptr ) { ready.set_value(); } );
+    asio::co_spawn( ioContext, server.startListener( "127.0.0.1", options.port, false ), asio::detached );
+    std::vector<std::thread> workers;
+    for ( int i = 0; i < options.threads; ++i )
+        workers.emplace_back( [&]() { ioContext.run(); } );
+    ready.get_future().wait();
+
+    // The clients run on their own thread, like separate processes would
+    asio::io_context clientContext;
+    const tcp::endpoint endpoint( asio::ip::make_address( "127.0.0.1" ), static_cast<unsigned short>( options.port ) );
+    std::atomic<size_t> joined = 0;
+    std::atomic<size_t> running = options.receivers;
+    std::atomic<uint64_t> delivered = 0;
+    uint64_t frames = 0;
+    uint64_t socketWrites = 0;
+    std::chrono::steady_clock::time_point start;
+    auto& stats = server.getWriteStats();
+
+    for ( size_t i = 0; i < options.receivers; ++i )
+        asio::co_spawn( clientContext, receive( endpoint, options.messages, joined, running, delivered ), asio::detached );
+    asio::co_spawn( clientContext,
+                    post( endpoint, options.messages, options.receivers, joined,
+                          [&]()
+                          {
+                              frames = stats.frames;
+                              socketWrites = stats.socketWrites;
+                              start = std::chrono::steady_clock::now();
+                          } ),
+                    asio::detached );
+    clientContext.run();
+    const auto end = std::chrono::steady_clock::now();
+
+    server.closeAllSessions();
+    ioContext.stop();
+    for ( auto& worker : workers )
+        worker.join();
+
+    return FanoutResult{ .delivered = delivered,
+                         .frames = stats.frames - frames,
+                         .socketWrites = stats.socketWrites - socketWrites,
+                         .seconds = std::chrono::duration<double>( end - start ).count() };
+}
+
+int main( int argc, char* argv[] )
+{
+    FanoutOptions options;
+    std::vector<size_t> coalescedBytes;
+
+    po::options_description description( "Broadcast fan-out socket writes benchmark" );
+    description.add_options()
+        ( "help,h", "Show this help" )
+        ( "port", po::value( &options.port )->default_value( 18080 ), "Port of the in-process server" )
+        ( "threads", po::value( &options.threads )->default_value( static_cast<int>( std::max( 1u, std::thread::hardware_concurrency() ) ) ),
+          "Threads running the server's io_context" )
+        ( "receivers", po::value( &options.receivers )->default_value( 200 ), "Sessions subscribed to the room" )
+        ( "messages", po::value( &options.messages )->default_value( 500 ), "Messages in the burst" )
+        ( "batch-window-us", po::value( &options.batch.windowMicros )->default_value( options.batch.windowMicros ),
+          "Batch window of the server, 0 sends every message as its own frame" )
+        ( "max-coalesced-bytes", po::value( &coalescedBytes )->multitoken()->default_value( { 0, SessionOptions{}.maxCoalescedBytes }, "0 65536" ),
+          "Settings to compare, 0 writes every frame on its own" );
+
+    try
+    {
+        po::variables_map variables;
+        po::store( po::parse_command_line( argc, argv, description ), variables );
+        po::notify( variables );
+        if ( variables.count( "help" ) )
+        {
+            std::cout << description << "\n";
+            return 0;
+        }
+        if ( options.threads < 1 or not options.receivers or not options.messages )
+            throw po::error( "--threads, --receivers and --messages must not be 0" );
+    }
+    catch ( const po::error& e )
+    {
+        std::cerr << "Error: " << e.what() << "\n" << description << "\n";
+        return 1;
+    }
+
+    // The server logs every request to std::cout, the results go around it
+    std::ostream results( std::cout.rdbuf() );
+    std::cout.rdbuf( nullptr );
+
+    results << options.threads << " threads, " << options.receivers << " receivers, " << options.messages << " messages, "
+            << Server::getBackend() << "\n";
+    results << std::setw( 10 ) << "coalesce" << std::setw( 12 ) << "delivered" << std::setw( 12 ) << "frames" << std::setw( 10 )
+            << "writes" << std::setw( 14 ) << "writes/msg" << std::setw( 12 ) << "msgs/s" << "\n";
+    for ( const size_t maxCoalescedBytes : coalescedBytes )
+    {
+        const auto result = run( options, maxCoalescedBytes );
+        results << std::setw( 10 ) << maxCoalescedBytes << std::setw( 12 ) << result.delivered << std::setw( 12 ) << result.frames
+                << std::setw( 10 ) << result.socketWrites << std::setw( 14 ) << std::fixed << std::setprecision( 3 )
+                << static_cast<double>( result.socketWrites ) / static_cast<double>( std::max<uint64_t>( result.delivered, 1 ) )
+                << std::setw( 12 ) << std::setprecision( 0 ) << static_cast<double>( result.delivered ) / result.seconds << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,202 @@
+#include "pch.hpp"
+#include "common/message.hpp"
+#include "common/response_datamodel.hpp"
+#include <iomanip>
+#include <new>
+
+// Allocations and throughput of JsonWriter against building a json tree and dumping it, for
+// history pages of growing size. Both have to produce the same bytes.
+
+// Every replaceable form of the global operator new is counted, and each delete form pairs with
+// them. The allocation itself stays out of line, so the compiler never sees malloc'd memory
+// reaching a delete expression or new'd memory reaching free.
+namespace
+{
+std::atomic<size_t> allocations = 0;
+
+[[gnu::noinline]] void* allocate( size_t size, std::align_val_t alignment = std::align_val_t( alignof( std::max_align_t ) ) )
+{
+    ++allocations;
+    const size_t align = std::max( static_cast<size_t>( alignment ), alignof( std::max_align_t ) );
+    // aligned_alloc wants a multiple of the alignment
+    if ( void* p = std::aligned_alloc( align, ( std::max( size, size_t{ 1 } ) + align - 1 ) / align * align ) )
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void deallocate( void* p ) noexcept
+{
+    std::free( p );
+}
+}
+
+void* operator new( size_t size )
+{
+    return allocate( size );
+}
+
+void* operator new[]( size_t size )
+{
+    return allocate( size );
+}
+
+void* operator new( size_t size, std::align_val_t alignment )
+{
+    return allocate( size, alignment );
+}
+
+void* operator new[]( size_t size, std::align_val_t alignment )
+{
+    return allocate( size, alignment );
+}
+
+void* operator new( size_t size, const std::nothrow_t& ) noexcept
+{
+    try
+    {
+        return allocate( size );
+    }
+    catch ( const std::bad_alloc& )
+    {
+        return nullptr;
+    }
+}
+
+void* operator new[]( size_t size, const std::nothrow_t& ) noexcept
+{
+    return operator new( size, std::nothrow );
+}
+
+void operator delete( void* p ) noexcept
+{
+    deallocate( p );
+}
+
+void operator delete[]( void* p ) noexcept
+{
+    deallocate( p );
+}
+
+void operator delete( void* p, size_t ) noexcept
+{
+    deallocate( p );
+}
+
+void operator delete[]( void* p, size_t ) noexcept
+{
+    deallocate( p );
+}
+
+void operator delete( void* p, std::align_val_t ) noexcept
+{
+    deallocate( p );
+}
+
+void operator delete[]( void* p, std::align_val_t ) noexcept
+{
+    deallocate( p );
+}
+
+void operator delete( void* p, size_t, std::align_val_t ) noexcept
+{
+    deallocate( p );
+}
+
+void operator delete[]( void* p, size_t, std::align_val_t ) noexcept
+{
+    deallocate( p );
+}
+
+void operator delete( void* p, const std::nothrow_t& ) noexcept
+{
+    deallocate( p );
+}
+
+void operator delete[]( void* p, const std::nothrow_t& ) noexcept
+{
+    deallocate( p );
+}
+
+struct EncodeResult
+{
+    double seconds = 0;
+    size_t allocations = 0;
+    size_t bytes = 0;
+};
+
+template <typename Encode>
+EncodeResult measure( size_t iterations, Encode&& encode )
+{
+    encode();  // Warms up thread-local buffers
+    const size_t before = allocations;
+    const auto start = std::chrono::steady_clock::now();
+    size_t bytes = 0;
+    for ( size_t i = 0; i < iterations; ++i )
+        bytes += encode().size();
+    return EncodeResult{ .seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count(),
+                         .allocations = allocations - before,
+                         .bytes = bytes };
+}
+
+int main( int argc, char* argv[] )
+{
+    size_t iterations = 0;
+    std::vector<size_t> pageSizes;
+
+    po::options_description description( "JsonWriter allocations and throughput benchmark" );
+    description.add_options()
+        ( "help,h", "Show this help" )
+        ( "iterations", po::value( &iterations )->default_value( 2000 ), "Pages encoded per size and encoder" )
+        ( "page-size", po::value( &pageSizes )->multitoken()->default_value( { 1, 50, 500 }, "1 50 500" ), "Messages per RoomHistory page" );
+
+    try
+    {
+        po::variables_map variables;
+        po::store( po::parse_command_line( argc, argv, description ), variables );
+        po::notify( variables );
+        if ( variables.count( "help" ) )
+        {
+            std::cout << description << "\n";
+            return 0;
+        }
+        if ( not iterations )
+            throw po::error( "--iterations must not be 0" );
+    }
+    catch ( const po::error& e )
+    {
+        std::cerr << "Error: " << e.what() << "\n" << description << "\n";
+        return 1;
+    }
+
+    std::cout << std::setw( 8 ) << "page" << std::setw( 12 ) << "encoder" << std::setw( 14 ) << "allocs/page" << std::setw( 12 )
+              << "pages/s" << std::setw( 10 ) << "MB/s" << "\n";
+    for ( const size_t pageSize : pageSizes )
+    {
+        HistoryPage page{ .room = "general", .cursor = 1, .hasMore = true };
+        for ( size_t i = 0; i < pageSize; ++i )
+            page.messages.push_back( ChatMessage{ .seq = i + 1,
+                                                  .sender = "user" + std::to_string( i % 20 ),
+                                                  .content = "message \"" + std::to_string( i ) + "\" with some text, é and a tab\t",
+                                                  .timestamp = 1'700'000'000'000 + static_cast<int64_t>( i ) } );
+        const auto message = wrapMessage( ServerMessageType::RoomHistory, page );
+
+        const auto tree = json( message ).dump();
+        const auto direct = writeJson( message );
+        if ( tree != direct )
+        {
+            std::cerr << "Error: JsonWriter output differs from json::dump for a page of " << pageSize << " messages\n";
+            return 1;
+        }
+
+        const std::pair<const char*, EncodeResult> results[] = {
+            { "json tree", measure( iterations, [&]() { return json( message ).dump(); } ) },
+            { "JsonWriter", measure( iterations, [&]() { return writeJson( message ); } ) },
+        };
+        for ( const auto& [name, result] : results )
+            std::cout << std::setw( 8 ) << pageSize << std::setw( 12 ) << name << std::setw( 14 ) << std::fixed << std::setprecision( 1 )
+                      << static_cast<double>( result.allocations ) / static_cast<double>( iterations ) << std::setw( 12 )
+                      << std::setprecision( 0 ) << static_cast<double>( iterations ) / result.seconds << std::setw( 10 )
+                      << std::setprecision( 1 ) << static_cast<double>( result.bytes ) / 1e6 / result.seconds << "\n";
+    }
+    return 0;
+}
@@ -0,0 +1,271 @@
+#include "pch.hpp"
+#include "load_client.hpp"
+#include <charconv>
+#include <future>
+#include <iomanip>
+#include <sys/resource.h>
+
+// Load generator for comparing server builds, e.g. epoll against CHAT_IO_URING: opens many
+// connections to a running server, spreads them over rooms and lets some of them post at a fixed
+// total rate. Every message carries its send time, so receivers measure the delivery latency.
+// Client and server have to run on the same host, the times are read from the steady clock.
+
+struct LoadOptions
+{
+    std::string address;
+    int port = 0;
+    int threads = 0;
+    size_t connections = 0;
+    size_t connectConcurrency = 0;
+    size_t rooms = 0;
+    size_t posters = 0;
+    double rate = 0;
+    double seconds = 0;
+};
+
+struct LoadStats
+{
+    std::atomic<size_t> connected = 0;
+    std::atomic<size_t> failed = 0;
+    std::atomic<uint64_t> sent = 0;
+    std::atomic<uint64_t> delivered = 0;
+    std::atomic<bool> measuring = false;
+    std::atomic<bool> stopping = false;
+    std::vector<std::vector<uint32_t>> latencies;  // Microseconds, per client so receivers never share one
+};
+
+int64_t steadyMicros()
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>( std::chrono::steady_clock::now().time_since_epoch() ).count();
+}
+
+std::string roomName( size_t index )
+{
+    return "load " + std::to_string( index );
+}
+
+// More descriptors than the default 1024 are needed for 10k connections
+void raiseDescriptorLimit( size_t connections )
+{
+    rlimit limit{};
+    if ( getrlimit( RLIMIT_NOFILE, &limit ) != 0 )
+        return;
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit( RLIMIT_NOFILE, &limit );
+    if ( limit.rlim_cur < connections + 64 )
+        std::cerr << "Warning: descriptor limit " << limit.rlim_cur << " is below " << connections << " connections\n";
+}
+
+awaitable<void> createRooms( tcp::endpoint endpoint, size_t rooms )
+{
+    LoadClient client( co_await asio::this_coro::executor );
+    co_await client.connect( endpoint );
+    for ( size_t i = 0; i < rooms; ++i )
+    {
+        const PostRoomRequest request{ .room = roomName( i ) };
+        co_await client.send( ClientMessageType::PostNewRoom, request );
+    }
+    // A join answers once every room exists, requests of a session are processed in order
+    const JoinRoomRequest request{ .room = roomName( rooms - 1 ) };
+    co_await client.send( ClientMessageType::JoinRoom, request );
+    while ( co_await client.read() != "RoomHistory" )
+        ;
+    co_await client.close();
+}
+
+void recordLatency( LoadStats& stats, std::vector<uint32_t>& latencies, const std::string& content, int64_t now )
+{
+    int64_t sent = 0;
+    if ( std::from_chars( content.data(), content.data() + content.size(), sent ).ec != std::errc() )
+        return;
+    latencies.push_back( static_cast<uint32_t>( std::clamp<int64_t>( now - sent, 0, UINT32_MAX ) ) );
+    ++stats.delivered;
+}
+
+awaitable<void> receive( LoadClient& client, std::vector<uint32_t>& latencies, LoadStats& stats )
+{
+    try
+    {
+        while ( not stats.stopping )
+        {
+            const auto type = co_await client.read();
+            if ( not stats.measuring )
+                continue;
+            const auto now = steadyMicros();
+            if ( type == "NewMessage" )
+                recordLatency( stats, latencies, client.data<NewMessage>().chatMessage.content, now );
+            else if ( type == "NewMessages" )
+                for ( const auto& message : client.data<NewMessages>().chatMessages )
+                    recordLatency( stats, latencies, message.content, now );
+        }
+    }
+    catch ( const std::exception& )
+    {
+        // Sockets are torn down at the end of the run
+    }
+}
+
+awaitable<void> post( LoadClient& client, std::string room, std::chrono::nanoseconds interval, LoadStats& stats )
+{
+    asio::steady_timer timer( co_await asio::this_coro::executor );
+    auto next = std::chrono::steady_clock::now();
+    try
+    {
+        while ( not stats.stopping )
+        {
+            next += interval;
+            timer.expires_at( next );
+            co_await timer.async_wait( asio::use_awaitable );
+            const PostMessageRequest request{ .user = "load", .room = room, .message = std::to_string( steadyMicros() ) };
+            co_await client.send( ClientMessageType::PostMessage, request );
+            ++stats.sent;
+        }
+    }
+    catch ( const std::exception& )
+    {
+    }
+}
+
+// Each lane connects its share of the clients one after another, bounding the connects in flight
+awaitable<void> connectLane( tcp::endpoint endpoint, std::vector<std::unique_ptr<LoadClient>>& clients, size_t lane,
+                             const LoadOptions& options, LoadStats& stats )
+{
+    for ( size_t i = lane; i < clients.size(); i += options.connectConcurrency )
+    {
+        auto& client = *clients[i];
+        try
+        {
+            co_await client.connect( endpoint );
+            const JoinRoomRequest request{ .room = roomName( i % options.rooms ) };
+            co_await client.send( ClientMessageType::JoinRoom, request );
+            while ( co_await client.read() != "RoomHistory" )
+                ;
+            asio::co_spawn( client.getExecutor(), receive( client, stats.latencies[i], stats ), asio::detached );
+            ++stats.connected;
+        }
+        catch ( const std::exception& e )
+        {
+            if ( stats.failed++ == 0 )
+                std::cerr << "Error: Connect failed: " << e.what() << "\n";
+        }
+    }
+}
+
+uint32_t percentile( const std::vector<uint32_t>& sorted, double fraction )
+{
+    if ( sorted.empty() )
+        return 0;
+    return sorted[std::min( sorted.size() - 1, static_cast<size_t>( fraction * static_cast<double>( sorted.size() ) ) )];
+}
+
+int main( int argc, char* argv[] )
+{
+    LoadOptions options;
+
+    po::options_description description( "Chat server load generator" );
+    description.add_options()
+        ( "help,h", "Show this help" )
+        ( "address", po::value( &options.address )->default_value( "127.0.0.1" ), "Server address" )
+        ( "port", po::value( &options.port )->default_value( 8080 ), "Server port" )
+        ( "threads", po::value( &options.threads )->default_value( static_cast<int>( std::max( 1u, std::thread::hardware_concurrency() ) ) ),
+          "Threads running the clients" )
+        ( "connections", po::value( &options.connections )->default_value( 10'000 ), "Connections opened to the server" )
+        ( "connect-concurrency", po::value( &options.connectConcurrency )->default_value( 100 ), "Connects in flight while ramping up" )
+        ( "rooms", po::value( &options.rooms )->default_value( 100 ), "Rooms the connections are spread over" )
+        ( "posters", po::value( &options.posters )->default_value( 100 ), "Connections that also post messages" )
+        ( "rate", po::value( &options.rate )->default_value( 1000 ), "Messages per second posted by all posters together" )
+        ( "seconds", po::value( &options.seconds )->default_value( 10 ), "Length of the measurement" );
+
+    try
+    {
+        po::variables_map variables;
+        po::store( po::parse_command_line( argc, argv, description ), variables );
+        po::notify( variables );
+        if ( variables.count( "help" ) )
+        {
+            std::cout << description << "\n";
+            return 0;
+        }
+        if ( options.threads < 1 or not options.connections or not options.connectConcurrency or not options.rooms )
+            throw po::error( "--threads, --connections, --connect-concurrency and --rooms must not be 0" );
+        if ( options.posters > options.connections or options.rate <= 0 or options.seconds <= 0 )
+            throw po::error( "needs at most --connections posters and a positive --rate and --seconds" );
+    }
+    catch ( const po::error& e )
+    {
+        std::cerr << "Error: " << e.what() << "\n" << description << "\n";
+        return 1;
+    }
+
+    raiseDescriptorLimit( options.connections );
+    asio::io_context ioContext( options.threads );
+    const tcp::endpoint endpoint( asio::ip::make_address( options.address ), static_cast<unsigned short>( options.port ) );
+    LoadStats stats;
+    stats.latencies.resize( options.connections );
+    std::vector<std::unique_ptr<LoadClient>> clients;
+    for ( size_t i = 0; i < options.connections; ++i )
+        clients.push_back( std::make_unique<LoadClient>( asio::make_strand( ioContext ) ) );
+
+    auto work = asio::make_work_guard( ioContext );
+    std::vector<std::thread> workers;
+    for ( int i = 0; i < options.threads; ++i )
+        workers.emplace_back( [&]() { ioContext.run(); } );
+
+    try
+    {
+        asio::co_spawn( ioContext, createRooms( endpoint, options.rooms ), asio::use_future ).get();
+    }
+    catch ( const std::exception& e )
+    {
+        std::cerr << "Error: Cannot create the rooms: " << e.what() << "\n";
+        ioContext.stop();
+        for ( auto& worker : workers )
+            worker.join();
+        return 1;
+    }
+
+    const auto rampStart = std::chrono::steady_clock::now();
+    std::vector<std::future<void>> lanes;
+    for ( size_t lane = 0; lane < std::min( options.connectConcurrency, options.connections ); ++lane )
+        lanes.push_back( asio::co_spawn( ioContext, connectLane( endpoint, clients, lane, options, stats ), asio::use_future ) );
+    for ( auto& lane : lanes )
+        lane.get();
+    std::cout << stats.connected << " connected, " << stats.failed << " failed in "
+              << std::chrono::duration<double>( std::chrono::steady_clock::now() - rampStart ).count() << " s\n";
+
+    // Posters keep the total rate however many of them connected
+    const size_t posters = std::min<size_t>( options.posters, stats.connected );
+    const auto interval = std::chrono::nanoseconds( static_cast<int64_t>( 1e9 * static_cast<double>( posters ) / options.rate ) );
+    stats.measuring = true;
+    const auto start = std::chrono::steady_clock::now();
+    for ( size_t i = 0, started = 0; i < clients.size() and started < posters; ++i )
+    {
+        if ( not clients[i]->isOpen() )
+            continue;
+        asio::co_spawn( clients[i]->getExecutor(), post( *clients[i], roomName( i % options.rooms ), interval, stats ), asio::detached );
+        ++started;
+    }
+
+    std::this_thread::sleep_for( std::chrono::duration<double>( options.seconds ) );
+    stats.measuring = false;
+    const auto sent = stats.sent.load();
+    const auto delivered = stats.delivered.load();
+    const double seconds = std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count();
+    stats.stopping = true;
+    work.reset();
+    ioContext.stop();
+    for ( auto& worker : workers )
+        worker.join();
+    clients.clear();
+
+    std::vector<uint32_t> latencies;
+    for ( const auto& client : stats.latencies )
+        latencies.insert( latencies.end(), client.begin(), client.end() );
+    std::ranges::sort( latencies );
+    std::cout << std::fixed << std::setprecision( 0 ) << sent << " sent (" << static_cast<double>( sent ) / seconds << "/s), " << delivered
+              << " delivered (" << static_cast<double>( delivered ) / seconds << "/s) in " << std::setprecision( 1 ) << seconds << " s\n";
+    std::cout << "latency us: p50 " << percentile( latencies, 0.5 ) << ", p90 " << percentile( latencies, 0.9 ) << ", p99 "
+              << percentile( latencies, 0.99 ) << ", p99.9 " << percentile( latencies, 0.999 ) << ", max "
+              << ( latencies.empty() ? 0 : latencies.back() ) << "\n";
+    return 0;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "common/message.hpp"
+#include "common/request_datamodel.hpp"
+#include "common/response_datamodel.hpp"
+
+// Bare websocket client for the benchmarks, speaking the Json wire format without compression
+class LoadClient
+{
+    websocket::stream<tcp::socket> webSocket_;
+    beast::flat_buffer buffer_;
+
+public:
+    explicit LoadClient( const asio::any_io_executor& executor )
+        : webSocket_( executor )
+    {}
+
+    asio::any_io_executor getExecutor()
+    {
+        return webSocket_.get_executor();
+    }
+
+    bool isOpen() const
+    {
+        return webSocket_.is_open();
+    }
+
+    awaitable<void> connect( const tcp::endpoint& endpoint )
+    {
+        auto& socket = webSocket_.next_layer();
+        co_await socket.async_connect( endpoint, asio::use_awaitable );
+        socket.set_option( tcp::no_delay( true ) );
+        co_await webSocket_.async_handshake( endpoint.address().to_string(), "/", asio::use_awaitable );
+    }
+
+    template <typename T>
+    awaitable<void> send( ClientMessageType type, const T& request )
+    {
+        const auto frame = makeMessage( type, request );
+        co_await webSocket_.async_write( asio::buffer( frame ), asio::use_awaitable );
+    }
+
+    // Reads the next frame and returns its type, the frame stays readable until the next read
+    awaitable<std::string> read()
+    {
+        buffer_.clear();
+        co_await webSocket_.async_read( buffer_, asio::use_awaitable );
+        MessageHeader header;
+        decodeMessage( frame(), WireFormat::Json, header );
+        co_return header.metadata.type;
+    }
+
+    std::string_view frame() const
+    {
+        return { static_cast<const char*>( buffer_.data().data() ), buffer_.size() };
+    }
+
+    template <typename T>
+    T data() const
+    {
+        Message<T> message;
+        decodeMessage( frame(), WireFormat::Json, message );
+        return std::move( message.data );
+    }
+
+    awaitable<void> close()
+    {
+        co_await webSocket_.async_close( websocket::close_code::normal, asio::use_awaitable );
+    }
+};
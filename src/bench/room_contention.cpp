@@ -0,0 +1,126 @@
+#include "pch.hpp"
+#include "server/database.hpp"
+#include <iomanip>
+
+// Cross-room contention of Database: writers append messages while readers page through the
+// rooms, first with every writer on one room, then with the writers spread over more rooms.
+// Rooms have their own strands, so throughput should grow with the rooms up to the thread count.
+
+struct ContentionResult
+{
+    double seconds = 0;
+    uint64_t pages = 0;
+};
+
+awaitable<void> writeMessages( Database& database, std::string room, size_t count, std::atomic<size_t>& running,
+                               std::chrono::steady_clock::time_point& end, std::atomic<bool>& done )
+{
+    for ( size_t i = 0; i < count; ++i )
+    {
+        ChatMessage message{ .sender = "bench", .content = "message " + std::to_string( i ) };
+        co_await database.addMessage( room, message );
+    }
+    // The last writer ends the run, which also stops the readers
+    if ( --running == 0 )
+    {
+        end = std::chrono::steady_clock::now();
+        done = true;
+    }
+}
+
+awaitable<void> readPages( const Database& database, const std::vector<std::string>& rooms, const std::atomic<bool>& done,
+                           std::atomic<uint64_t>& pages )
+{
+    for ( size_t i = 0; not done; ++i )
+    {
+        co_await database.getRoomPage( rooms[i % rooms.size()], UINT64_MAX, 50 );
+        ++pages;
+    }
+}
+
+ContentionResult run( int threads, size_t roomCount, size_t writers, size_t messages, size_t readers )
+{
+    asio::io_context ioContext( threads );
+    Database database( ioContext, {}, {}, {}, static_cast<size_t>( threads ) );
+
+    std::vector<std::string> rooms;
+    for ( size_t i = 0; i < roomCount; ++i )
+        rooms.push_back( "room " + std::to_string( i ) );
+    asio::co_spawn( ioContext,
+        [&]() -> awaitable<void>
+        {
+            for ( const auto& room : rooms )
+                co_await database.addRoom( room );
+        },
+        asio::detached );
+    ioContext.run();
+    ioContext.restart();
+
+    std::atomic<bool> done = false;
+    std::atomic<uint64_t> pages = 0;
+    std::atomic<size_t> running = writers;
+    std::chrono::steady_clock::time_point end;
+    for ( size_t i = 0; i < writers; ++i )
+        asio::co_spawn( ioContext, writeMessages( database, rooms[i % rooms.size()], messages / writers, running, end, done ), asio::detached );
+    for ( size_t i = 0; i < readers; ++i )
+        asio::co_spawn( ioContext, readPages( database, rooms, done, pages ), asio::detached );
+
+    const auto start = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    for ( int i = 1; i < threads; ++i )
+        workers.emplace_back( [&]() { ioContext.run(); } );
+    ioContext.run();
+    for ( auto& worker : workers )
+        worker.join();
+
+    return ContentionResult{ .seconds = std::chrono::duration<double>( end - start ).count(), .pages = pages };
+}
+
+int main( int argc, char* argv[] )
+{
+    int threads = 0;
+    size_t writers = 0;
+    size_t messages = 0;
+    size_t readers = 0;
+    std::vector<size_t> roomCounts;
+
+    po::options_description description( "Database cross-room contention benchmark" );
+    description.add_options()
+        ( "help,h", "Show this help" )
+        ( "threads", po::value( &threads )->default_value( static_cast<int>( std::max( 1u, std::thread::hardware_concurrency() ) ) ),
+          "Threads running the io_context" )
+        ( "writers", po::value( &writers )->default_value( 64 ), "Concurrent writers, spread round-robin over the rooms" )
+        ( "messages", po::value( &messages )->default_value( 1'000'000 ), "Messages appended per run" )
+        ( "readers", po::value( &readers )->default_value( 4 ), "Concurrent readers paging through the rooms during the run" )
+        ( "rooms", po::value( &roomCounts )->multitoken()->default_value( { 1, 4, 16, 64 }, "1 4 16 64" ), "Room counts to compare" );
+
+    try
+    {
+        po::variables_map variables;
+        po::store( po::parse_command_line( argc, argv, description ), variables );
+        po::notify( variables );
+        if ( variables.count( "help" ) )
+        {
+            std::cout << description << "\n";
+            return 0;
+        }
+        if ( not writers or messages < writers )
+            throw po::error( "needs at least one writer and one message per writer" );
+    }
+    catch ( const po::error& e )
+    {
+        std::cerr << "Error: " << e.what() << "\n" << description << "\n";
+        return 1;
+    }
+
+    std::cout << threads << " threads, " << writers << " writers, " << messages << " messages, " << readers << " readers\n";
+    std::cout << std::setw( 8 ) << "rooms" << std::setw( 16 ) << "messages/s" << std::setw( 14 ) << "pages/s" << "\n";
+    for ( const size_t rooms : roomCounts )
+    {
+        const auto result = run( threads, std::max<size_t>( rooms, 1 ), writers, messages, readers );
+        std::cout << std::setw( 8 ) << rooms << std::setw( 16 ) << std::fixed << std::setprecision( 0 )
+                  << static_cast<double>( messages / writers * writers ) / result.seconds << std::setw( 14 )
+                  << static_cast<double>( result.pages ) / result.seconds << "\n";
+    }
+    return 0;
+}
@@ -1,9 +1,11 @@
 #pragma once
 #include "client_data.hpp"
+#include "common/compression.hpp"
 #include "common/message.hpp"
 #include "common/response_datamodel.hpp"
 #include "common/request_datamodel.hpp"
 #include <queue>
+#include <set>
 #include <thread>
 
 namespace beast = boost::beast;
@@ -21,6 +23,12 @@ private:
 
     asio::io_context ioContext_;
     websocket::stream<tcp::socket> websocket_;
+    CompressionOptions compressionOptions_;
+
+    // Offered in order of preference, the server picks one during the handshake
+    std::vector<WireFormat> offeredWireFormats_ = { WireFormat::Cbor, WireFormat::Json };
+    WireFormat wireFormat_ = WireFormat::Json;
+    uint64_t historyPageSize_ = 50;
 
     std::thread readThread_;
     std::thread writeThread_;
@@ -28,6 +36,10 @@ private:
     std::mutex writeQueueMutex_;
     std::condition_variable writeQueueCondVar_;
 
+    // Rooms whose live messages this session receives, sends for them are ordered under the mutex
+    std::set<std::string> joinedRooms_;
+    std::mutex joinedRoomsMutex_;
+
     // UI components
     std::string connectionStatus_ = "Disconnected";
     std::string connectionErrorStatus_;
@@ -72,9 +84,23 @@ public:
 
             // Set timeout and server decorator
             websocket_.set_option( websocket::stream_base::timeout::suggested( beast::role_type::client ) );
+            websocket_.set_option( compressionOptions_.toOption( beast::role_type::client ) );
+
+            // Perform WebSocket handshake, offering the binary wire formats as subprotocols
+            std::string protocols;
+            for ( auto format : offeredWireFormats_ )
+                protocols += ( protocols.empty() ? "" : ", " ) + std::string( wireFormatProtocol( format ) );
+            websocket_.set_option( websocket::stream_base::decorator(
+                [protocols]( websocket::request_type& request )
+                { request.set( http::field::sec_websocket_protocol, protocols ); } ) );
 
-            // Perform WebSocket handshake
-            websocket_.handshake( serverAddress_, "/" );
+            websocket::response_type response;
+            websocket_.handshake( response, serverAddress_, "/" );
+
+            const auto accepted = response[http::field::sec_websocket_protocol];
+            wireFormat_ = negotiateWireFormat( std::string_view( accepted.data(), accepted.size() ) )
+                              .value_or( WireFormat::Json );
+            websocket_.binary( wireFormat_ != WireFormat::Json );
 
             isConnected_ = true;
             connectionStatus_ = "Connected to " + serverAddress_ + ":" + serverPort_;
@@ -83,8 +109,12 @@ public:
             startReadLoop();
             startWriteLoop();
 
-            // Request initial chat rooms and messages
-            sendMessage( makeMessage( ClientMessageType::InitSession, json() ) );
+            // Request the rooms and whatever messages were missed since the last connection
+            {
+                std::scoped_lock lock( joinedRoomsMutex_ );
+                joinedRooms_.clear();
+            }
+            requestResync();
         }
         catch ( std::exception& e )
         {
@@ -148,16 +178,66 @@ public:
             .room = room,
             .message = content,
         };
-        sendMessage( makeMessage( ClientMessageType::PostMessage, req ) );
+        sendMessage( makeMessage( ClientMessageType::PostMessage, req, wireFormat_ ) );
     }
 
     void sendChatRoom( const std::string& room )
     {
         PostRoomRequest req{ .room = room };
-        sendMessage( makeMessage( ClientMessageType::PostNewRoom, req ) );
+        sendMessage( makeMessage( ClientMessageType::PostNewRoom, req, wireFormat_ ) );
+    }
+
+    void joinRoom( const std::string& room )
+    {
+        std::scoped_lock lock( joinedRoomsMutex_ );
+        joinedRooms_.insert( room );
+        sendJoinRoom( room );
+    }
+
+    void leaveRoom( const std::string& room )
+    {
+        std::scoped_lock lock( joinedRoomsMutex_ );
+        joinedRooms_.erase( room );
+        LeaveRoomRequest req{ .room = room };
+        sendMessage( makeMessage( ClientMessageType::LeaveRoom, req, wireFormat_ ) );
+    }
+
+    // Requests the page preceding the oldest loaded message, if there is one
+    void fetchOlderMessages( const std::string& room )
+    {
+        auto cursor = clientData_.getHistoryCursor( room );
+        if ( not cursor )
+            return;
+
+        FetchHistoryRequest req{ .room = room, .before = cursor.value(), .limit = historyPageSize_ };
+        sendMessage( makeMessage( ClientMessageType::FetchHistory, req, wireFormat_ ) );
     }
 
 private:
+    // The history the server sends back starts at the first seq the client is missing
+    void sendJoinRoom( const std::string& room )
+    {
+        JoinRoomRequest req{ .room = room,
+                            .serverId = clientData_.getServerId(),
+                            .since = clientData_.getSince( room ) };
+        sendMessage( makeMessage( ClientMessageType::JoinRoom, req, wireFormat_ ) );
+    }
+
+    // Live messages skipped seqs, joining again keeps the subscription and fetches what is missing.
+    // A room left meanwhile is not joined again, its next join fetches the gap anyway.
+    void fillGap( const std::string& room )
+    {
+        std::scoped_lock lock( joinedRoomsMutex_ );
+        if ( joinedRooms_.contains( room ) )
+            sendJoinRoom( room );
+    }
+
+    void requestResync()
+    {
+        InitSessionRequest req{ .serverId = clientData_.getServerId(), .since = clientData_.getSince() };
+        sendMessage( makeMessage( ClientMessageType::InitSession, req, wireFormat_ ) );
+    }
+
     void sendMessage( const std::string& message )
     {
         if ( not isConnected_ or message.empty() )
@@ -175,26 +255,30 @@ private:
         readThread_ = std::thread(
             [this]()
             {
+                // Reused across reads so its capacity is only grown once
+                beast::flat_buffer buffer;
                 while ( isConnected_ and isRunning_ )
                 {
                     try
                     {
-                        beast::flat_buffer buffer;
                         websocket_.read( buffer );
-                        auto message = beast::buffers_to_string( buffer.data() );
-                        json messageJson = nlohmann::json::parse( std::move( message ) );
-                        
-                        auto typeStr = messageJson.at( "metadata" ).at( "type" ).get<std::string>();
+                        const auto data = buffer.data();
+                        json messageJson = decodeMessage(
+                            std::string_view( static_cast<const char*>( data.data() ), data.size() ), wireFormat_ );
+
+                        const auto& typeStr = messageJson.at( "metadata" ).at( "type" ).get_ref<const std::string&>();
                         auto type = magic_enum::enum_cast<ServerMessageType>( typeStr );
-                        json dataJson = messageJson["data"];
+                        const json& dataJson = messageJson.at( "data" );
                         
                         switch ( type.value() )
                         {
                             case ServerMessageType::InitSessionResponse:
                             {
+                                // History follows as RoomHistory pieces, applied as they arrive
                                 auto response = dataJson.get<InitSessionResponse>();
-                                for ( const auto& room : response.roomsMessages )
-                                    clientData_.addMessages( room.name, room.messages );
+                                clientData_.setServerId( response.serverId );
+                                for ( const auto& room : response.rooms )
+                                    clientData_.addRoom( room );
                                 break;
                             }
                             case ServerMessageType::NewRoom:
@@ -206,7 +290,31 @@ private:
                             case ServerMessageType::NewMessage:
                             {
                                 auto response = dataJson.get<NewMessage>();
-                                clientData_.addMessage( response.room, response.chatMessage );
+                                if ( clientData_.addMessage( response.room, response.chatMessage ) )
+                                    fillGap( response.room );
+                                break;
+                            }
+                            case ServerMessageType::NewMessages:
+                            {
+                                auto response = dataJson.get<NewMessages>();
+                                if ( clientData_.addMessages( response.room, std::move( response.chatMessages ) ) )
+                                    fillGap( response.room );
+                                break;
+                            }
+                            case ServerMessageType::RoomHistory:
+                            {
+                                clientData_.mergeRoomPage( dataJson.get<HistoryPage>() );
+                                break;
+                            }
+                            case ServerMessageType::HistoryPage:
+                            {
+                                clientData_.prependRoomPage( dataJson.get<HistoryPage>() );
+                                break;
+                            }
+                            case ServerMessageType::ResyncRequired:
+                            {
+                                // Frames after this one are merged by seq, so the delta fills the gap
+                                requestResync();
                                 break;
                             }
                         }
@@ -1,10 +1,24 @@
 #pragma once
 #include "common/datamodel.hpp"
+#include "common/response_datamodel.hpp"
 
 class ClientData
 {
+    using MessageList = std::vector<ChatMessage>;
+
+    // Loaded tail of a room's history, ordered by seq, and where the next older page starts.
+    // Messages are shared with readers and copied only when changed while a reader holds them.
+    struct Room
+    {
+        std::shared_ptr<MessageList> messages = std::make_shared<MessageList>();
+        uint64_t cursor = 0;
+        bool hasMore = false;
+        bool fillingGap = false;  // Skipped seqs were requested and their page has not arrived yet
+    };
+
     std::string userName_;
-    std::unordered_map<std::string, ChatRoom> chats_;
+    std::unordered_map<std::string, Room> chats_;
+    std::optional<uint64_t> serverId_;
     std::mutex messagesMutex_;
 
 public:
@@ -21,28 +35,106 @@ public:
         return userName_;
     }
 
-    void addMessage( const std::string& room, 
+    // Seqs are per server history, everything loaded from another one is dropped
+    void setServerId( uint64_t serverId )
+    {
+        std::scoped_lock lock( messagesMutex_ );
+        if ( serverId_ != serverId )
+            chats_.clear();
+        serverId_ = serverId;
+    }
+
+    // The server the loaded seqs came from, 0 before the first InitSessionResponse
+    uint64_t getServerId()
+    {
+        std::scoped_lock lock( messagesMutex_ );
+        return serverId_.value_or( 0 );
+    }
+
+    // Both return true when live messages skip seqs past the loaded ones, e.g. frames the server
+    // dropped for a slow client, and the gap was not reported yet. getSince then starts at the gap.
+    bool addMessage( const std::string& room, 
                      const ChatMessage& msg )
     {
         std::scoped_lock lock( messagesMutex_ );
-        chats_[room].messages.push_back( msg );
+        return mergeLive( chats_[room], { msg } );
     }
 
-    void addMessages( const std::string& roomName, 
-                      const std::vector<ChatMessage>& msgs )
+    bool addMessages( const std::string& room, std::vector<ChatMessage> messages )
     {
         std::scoped_lock lock( messagesMutex_ );
-        auto& room = chats_[roomName];
-        for ( const auto& msg : msgs )
-            room.messages.push_back( msg );
+        return mergeLive( chats_[room], std::move( messages ) );
     }
 
-    void addRoom( const std::string& room )
+    // Page continuing the loaded messages (a delta, or the whole room) is merged into them,
+    // a page leaving a gap replaces the ones up to its end
+    void mergeRoomPage( HistoryPage page )
+    {
+        std::scoped_lock lock( messagesMutex_ );
+        auto& room = chats_[page.room];
+        if ( not room.messages->empty() and continuesRoom( room, page ) )
+        {
+            room.fillingGap = false;
+            mergeMessages( room, std::move( page.messages ) );
+            return;
+        }
+
+        // A join subscribes before reading the page, so newer messages may have arrived ahead of it
+        const uint64_t end = page.messages.empty() ? page.cursor : page.messages.back().seq + 1;
+        const auto& loaded = *room.messages;
+        auto newer = std::lower_bound( loaded.begin(), loaded.end(), end,
+                                       []( const ChatMessage& msg, uint64_t seq ) { return msg.seq < seq; } );
+        page.messages.insert( page.messages.end(), newer, loaded.end() );
+
+        room = Room{ .messages = std::make_shared<MessageList>( std::move( page.messages ) ),
+                     .cursor = page.cursor,
+                     .hasMore = page.hasMore };
+    }
+
+    // Older page, goes in front of the loaded messages
+    void prependRoomPage( HistoryPage page )
+    {
+        std::scoped_lock lock( messagesMutex_ );
+        auto& room = chats_[page.room];
+        mergeMessages( room, std::move( page.messages ) );
+        room.cursor = page.cursor;
+        room.hasMore = page.hasMore;
+    }
+
+    // Seq of the first message missing from each loaded room, see InitSessionRequest
+    std::map<std::string, uint64_t> getSince()
+    {
+        std::scoped_lock lock( messagesMutex_ );
+        std::map<std::string, uint64_t> since;
+        for ( const auto& [name, room] : chats_ )
+            if ( not room.messages->empty() )
+                since.emplace( name, firstMissing( *room.messages ) );
+        return since;
+    }
+
+    uint64_t getSince( const std::string& room )
     {
         std::scoped_lock lock( messagesMutex_ );
         auto it = chats_.find( room );
-        if ( it == chats_.end() )
-            chats_.emplace( room, ChatRoom{ .name = room } );
+        if ( it == chats_.end() or it->second.messages->empty() )
+            return 0;
+        return firstMissing( *it->second.messages );
+    }
+
+    // Cursor of the next older page, if the room has one
+    std::optional<uint64_t> getHistoryCursor( const std::string& room )
+    {
+        std::scoped_lock lock( messagesMutex_ );
+        auto it = chats_.find( room );
+        if ( it == chats_.end() or not it->second.hasMore )
+            return std::nullopt;
+        return it->second.cursor;
+    }
+
+    void addRoom( const std::string& room )
+    {
+        std::scoped_lock lock( messagesMutex_ );
+        chats_.try_emplace( room );
     }
 
     std::vector<std::string> getRoomNames()
@@ -54,12 +146,13 @@ public:
         return names;
     }
 
-    std::vector<ChatMessage> getRoomMessages( const std::string& room )
+    // Shared, not copied, so rendering a long room costs nothing per frame
+    std::shared_ptr<const MessageList> getRoomMessages( const std::string& room )
     {
         std::scoped_lock lock( messagesMutex_ );
         auto it = chats_.find( room );
         if ( it == chats_.end() )
-            return {};
+            return std::make_shared<const MessageList>();
         return it->second.messages;
     }
 
@@ -67,5 +160,64 @@ public:
     {
         std::scoped_lock lock( messagesMutex_ );
         chats_.clear();
+        serverId_.reset();
+    }
+
+private:
+    // End of the gapless run the loaded messages start with
+    static uint64_t firstMissing( const MessageList& messages )
+    {
+        auto gap = std::ranges::adjacent_find( messages, []( const ChatMessage& a, const ChatMessage& b ) { return b.seq != a.seq + 1; } );
+        return gap == messages.end() ? messages.back().seq + 1 : gap->seq + 1;
+    }
+
+    static bool mergeLive( Room& room, MessageList incoming )
+    {
+        const bool gap = not room.fillingGap and not room.messages->empty() and not incoming.empty() and
+                         incoming.front().seq > room.messages->back().seq + 1;
+        room.fillingGap = room.fillingGap or gap;
+        mergeMessages( room, std::move( incoming ) );
+        return gap;
+    }
+
+    static bool continuesRoom( const Room& room, const HistoryPage& page )
+    {
+        if ( page.messages.empty() or page.messages.front().seq == 0 )
+            return true;
+        // The client holds the message right before the page
+        const uint64_t previous = page.messages.front().seq - 1;
+        const auto& messages = *room.messages;
+        auto it = std::lower_bound( messages.begin(), messages.end(), previous,
+                                    []( const ChatMessage& msg, uint64_t seq ) { return msg.seq < seq; } );
+        return it != messages.end() and it->seq == previous;
+    }
+
+    // Sorted union by seq, messages already loaded are kept as they are
+    static void mergeMessages( Room& room, MessageList incoming )
+    {
+        // Readers only get a copy of the pointer under the mutex, so a count of 1 is reliable
+        if ( room.messages.use_count() > 1 )
+            room.messages = std::make_shared<MessageList>( *room.messages );
+
+        auto& messages = *room.messages;
+        auto bySeq = []( const ChatMessage& a, const ChatMessage& b ) { return a.seq < b.seq; };
+        if ( messages.empty() and not incoming.empty() )
+            room.cursor = incoming.front().seq;
+
+        // Common case: everything is newer than the loaded tail
+        if ( messages.empty() or incoming.empty() or messages.back().seq < incoming.front().seq )
+        {
+            messages.insert( messages.end(),
+                             std::make_move_iterator( incoming.begin() ),
+                             std::make_move_iterator( incoming.end() ) );
+            return;
+        }
+
+        MessageList merged;
+        merged.reserve( messages.size() + incoming.size() );
+        std::set_union( std::make_move_iterator( messages.begin() ), std::make_move_iterator( messages.end() ),
+                        std::make_move_iterator( incoming.begin() ), std::make_move_iterator( incoming.end() ),
+                        std::back_inserter( merged ), bySeq );
+        messages = std::move( merged );
     }
-};
\ No newline at end of file
+};
@@ -33,6 +33,7 @@ class ChatClientUI
     
     // Rooms
     std::string selectedRoom_;
+    std::string joinedRoom_;
     int selectedRoomIndex_ = 0;
     std::vector<std::string> roomsRadio_;
     std::string newRoomInput_;
@@ -49,6 +50,7 @@ class ChatClientUI
 
     Component messageField_;
     Component sendButton_;
+    Component loadOlderButton_;
     Component roomsRadiobox_;
     Component newRoomField_;
     Component createRoomButton_;
@@ -75,7 +77,8 @@ private:
     {
         if ( !client_.isConnected() )
         {
-            clientData_.clear();
+            // Loaded history is kept, InitSession only fetches what was missed meanwhile
+            joinedRoom_.clear();
             clientData_.setUserName( usernameInput_ );
             client_.setServer( addresInput_, portInput_ );
             client_.connect();
@@ -97,6 +100,12 @@ private:
         }
     }
 
+    void onLoadOlder()
+    {
+        if ( !selectedRoom_.empty() && client_.isConnected() )
+            client_.fetchOlderMessages( selectedRoom_ );
+    }
+
     void onCreateRoom()
     {
         if ( !newRoomInput_.empty() && client_.isConnected() )
@@ -106,8 +115,65 @@ private:
         }
     }
 
+    void onSelectRoom()
+    {
+        if ( selectedRoomIndex_ >= 0 && selectedRoomIndex_ < roomsRadio_.size() )
+            selectedRoom_ = roomsRadio_[selectedRoomIndex_];
+        syncJoinedRoom();
+    }
+
+    // Picks up rooms the server announced, keeping the selection where it still exists
+    void refreshRooms()
+    {
+        auto newRooms = clientData_.getRoomNames();
+        if ( newRooms != roomsRadio_ )
+        {
+            // Save current selection
+            std::string previouslySelected = selectedRoom_;
+
+            // Update vector in place to maintain the pointer reference
+            roomsRadio_.clear();
+            roomsRadio_.insert( roomsRadio_.end(), newRooms.begin(), newRooms.end() );
+
+            // Restore selection if it still exists
+            auto it = std::ranges::find( roomsRadio_, previouslySelected );
+            if ( it != roomsRadio_.end() )
+            {
+                selectedRoomIndex_ = std::distance( roomsRadio_.begin(), it );
+                selectedRoom_ = *it;
+            }
+            else if ( !roomsRadio_.empty() )
+            {
+                selectedRoomIndex_ = 0;
+                selectedRoom_ = roomsRadio_.front();
+            }
+            else
+            {
+                selectedRoomIndex_ = 0;
+                selectedRoom_ = "";
+            }
+        }
+        syncJoinedRoom();
+    }
+
+    // Only the selected room is subscribed, so new messages arrive for it alone
+    void syncJoinedRoom()
+    {
+        if ( selectedRoom_ == joinedRoom_ or not client_.isConnected() )
+            return;
+
+        if ( not joinedRoom_.empty() )
+            client_.leaveRoom( joinedRoom_ );
+        if ( not selectedRoom_.empty() )
+            client_.joinRoom( selectedRoom_ );
+        joinedRoom_ = selectedRoom_;
+    }
+
     bool handleEvent( Event event )
     {
+        // Ahead of the components, so the radiobox sees the current rooms
+        refreshRooms();
+
         // Tab to cycle through tabs
         if ( event == Event::Tab )
         {
@@ -132,8 +198,13 @@ private:
         sendButton_ |=
             CatchEvent( [&]( Event event ) { return event == Event::Return ? true : false; } );
 
+        // Older history is fetched page by page
+        loadOlderButton_ = Button( "Load older", [this] { onLoadOlder(); } );
+
         // Room selector
-        roomsRadiobox_ = Radiobox( &roomsRadio_, &selectedRoomIndex_ );
+        RadioboxOption roomsOption;
+        roomsOption.on_change = [this] { onSelectRoom(); };
+        roomsRadiobox_ = Radiobox( &roomsRadio_, &selectedRoomIndex_, roomsOption );
 
         // New room creation
         newRoomField_ = Input( &newRoomInput_, "New room name..." );
@@ -161,7 +232,7 @@ private:
         } );
         auto chatTab = Container::Horizontal( {
             roomsContainer,
-            Container::Vertical( { messageInputContainer } ),
+            Container::Vertical( { loadOlderButton_, messageInputContainer } ),
         } );
 
         auto mainContainer = Container::Vertical( {
@@ -255,42 +326,6 @@ private:
 
     Element renderChatRooms()
     {
-        // Update vector contents in place instead of reassigning
-        auto newRooms = clientData_.getRoomNames();
-        if ( newRooms != roomsRadio_ )
-        {
-            // Save current selection
-            std::string previouslySelected = selectedRoom_;
-
-            // Update vector in place to maintain the pointer reference
-            roomsRadio_.clear();
-            roomsRadio_.insert( roomsRadio_.end(), newRooms.begin(), newRooms.end() );
-
-            // Restore selection if it still exists
-            auto it = std::ranges::find( roomsRadio_, previouslySelected );
-            if ( it != roomsRadio_.end() )
-            {
-                selectedRoomIndex_ = std::distance( roomsRadio_.begin(), it );
-                selectedRoom_ = *it;
-            }
-            else if ( !roomsRadio_.empty() )
-            {
-                selectedRoomIndex_ = 0;
-                selectedRoom_ = roomsRadio_.front();
-            }
-            else
-            {
-                selectedRoomIndex_ = 0;
-                selectedRoom_ = "";
-            }
-        }
-        else
-        {
-            // Sync selectedRoom_ with current index
-            if ( selectedRoomIndex_ >= 0 && selectedRoomIndex_ < roomsRadio_.size() )
-                selectedRoom_ = roomsRadio_[selectedRoomIndex_];
-        }
-
         return vbox( {
                    text( "Chat Rooms" ) | bold | center,
                    separator(),
@@ -308,12 +343,14 @@ private:
     {
         const auto msgs = clientData_.getRoomMessages( selectedRoom_ );
         Elements messageElements;
-        for ( const auto& msg : msgs )
+        for ( const auto& msg : *msgs )
             messageElements.push_back( text( msg.content ) );
  
+        const bool hasOlder = clientData_.getHistoryCursor( selectedRoom_ ).has_value();
         return vbox( {
                         text( "Chat Messages" ) | bold | center,
                         separator(),
+                        loadOlderButton_->Render() | ( hasOlder && client_.isConnected() ? color( Color::Green ) : dim ),
                         vbox( messageElements ) | frame | yflex | focusPositionRelative( 1.0f, 0.0f ),
                      } ) | borderStyled( ROUNDED ) | flex;
     }
@@ -0,0 +1,27 @@
+#pragma once
+
+// permessage-deflate settings, negotiated during the websocket handshake
+struct CompressionOptions
+{
+    bool enabled = true;
+    int windowBits = 15;             // 9..15, smaller windows bound memory per connection
+    int memLevel = 4;                // 1..9, deflate state size
+    int compressionLevel = 6;        // 0..9
+    size_t minSize = 256;            // Smaller messages are sent uncompressed
+    bool noContextTakeover = false;  // Reset the deflate state after every message
+
+    websocket::permessage_deflate toOption( beast::role_type role ) const
+    {
+        websocket::permessage_deflate option;
+        option.server_enable = enabled and role == beast::role_type::server;
+        option.client_enable = enabled and role == beast::role_type::client;
+        option.server_max_window_bits = windowBits;
+        option.client_max_window_bits = windowBits;
+        option.server_no_context_takeover = noContextTakeover;
+        option.client_no_context_takeover = noContextTakeover;
+        option.compLevel = compressionLevel;
+        option.memLevel = memLevel;
+        option.msg_size_threshold = minSize;
+        return option;
+    }
+};
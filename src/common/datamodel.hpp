@@ -1,16 +1,11 @@
 #pragma once
+#include "json_writer.hpp"
 
 struct ChatMessage
 {
+    uint64_t seq = 0;  // Position in the room, assigned by the server and never reused
     std::string sender;
     std::string content;
-    std::string timestamp;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE( ChatMessage, sender, content, timestamp )
-};
-
-struct ChatRoom
-{
-    std::string name;
-    std::vector<ChatMessage> messages;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE( ChatRoom, name, messages )
+    int64_t timestamp = 0;  // Milliseconds since the Unix epoch
+    DEFINE_JSON_TYPE_INTRUSIVE( ChatMessage, seq, sender, content, timestamp )
 };
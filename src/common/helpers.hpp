@@ -1,7 +1,5 @@
 #pragma once
 #include <chrono>
-#include <iomanip>
-#include <sstream>
 
 // Helper function to format WebSocket errors
 inline std::string formatWebSocketError( const boost::system::error_code& errorCode )
@@ -24,11 +22,51 @@ inline std::string formatWebSocketError( const boost::system::error_code& errorC
     return errorMsg;
 }
 
-inline std::string getTimestamp()
+// Runs function on executor (e.g. a strand) and resumes the caller on its own executor
+template <typename Executor, typename Function>
+awaitable<std::invoke_result_t<Function&>> runOn( const Executor& executor, Function function )
 {
-    auto now = std::chrono::system_clock::now();
-    auto timePoint = std::chrono::system_clock::to_time_t( now );
-    std::stringstream ss;
-    ss << std::put_time( std::localtime( &timePoint ), "%H:%M:%S" );
-    return ss.str();
-}
\ No newline at end of file
+    co_return co_await asio::co_spawn(
+        executor,
+        [&function]() -> awaitable<std::invoke_result_t<Function&>> { co_return function(); },
+        asio::use_awaitable );
+}
+
+// Milliseconds since the Unix epoch
+inline int64_t getTimestamp()
+{
+    auto now = std::chrono::system_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::milliseconds>( now ).count();
+}
+
+// Coroutines sleeping until a condition may have changed. Each waits on a timer of its own:
+// arming a timer cancels the waits already pending on it, so waiters sharing one timer would
+// keep waking each other. Waiting and notifying must happen on the same strand
+class WaitList
+{
+    std::vector<asio::steady_timer*> waiters_;
+
+public:
+    awaitable<void> wait()
+    {
+        asio::steady_timer timer( co_await asio::this_coro::executor, asio::steady_timer::time_point::max() );
+        waiters_.push_back( &timer );
+        boost::system::error_code ec;
+        co_await timer.async_wait( asio::redirect_error( asio::use_awaitable, ec ) );
+        std::erase( waiters_, &timer );
+    }
+
+    void notifyOne()
+    {
+        if ( waiters_.empty() )
+            return;
+        waiters_.front()->cancel();
+        waiters_.erase( waiters_.begin() );
+    }
+
+    void notifyAll()
+    {
+        for ( auto* timer : std::exchange( waiters_, {} ) )
+            timer->cancel();
+    }
+};
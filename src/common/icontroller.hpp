@@ -1,9 +1,13 @@
 #pragma once
 
+// Handles one request type, the dispatcher decodes the payload into Request before the call
+template <typename Request>
 class IController
 {
 public:
+    using RequestType = Request;
+
     IController() = default;
     virtual ~IController() = default;
-    virtual awaitable<void> call( const size_t sessionId, const json& msg ) = 0;
-};
\ No newline at end of file
+    virtual awaitable<void> call( const size_t sessionId, const Request& request ) = 0;
+};
@@ -0,0 +1,444 @@
+#pragma once
+#include "json_writer.hpp"
+#include <bit>
+#include <map>
+
+struct JsonSlotOps;
+
+// Where the next decoded value goes: a member, element or map entry of the struct being read
+struct JsonSlot
+{
+    void* target = nullptr;
+    const JsonSlotOps* ops = nullptr;  // Nothing for values that are skipped, e.g. unknown members
+};
+
+// How a value is stored into a slot of one type, generated per type at compile time.
+// An event the type has no operation for is a type mismatch.
+struct JsonSlotOps
+{
+    void ( *string )( void* target, std::string& value ) = nullptr;
+    void ( *integer )( void* target, int64_t value ) = nullptr;
+    void ( *unsignedInteger )( void* target, uint64_t value ) = nullptr;
+    void ( *boolean )( void* target, bool value ) = nullptr;
+    // Objects: slot of the key's value; field is set to the index of a described member
+    JsonSlot ( *member )( void* target, std::string_view key, size_t& field ) = nullptr;
+    JsonSlot ( *element )( void* target ) = nullptr;  // Arrays: slot of the next element
+    void ( *complete )( uint64_t seen ) = nullptr;    // Described objects: throws unless every member was seen
+};
+
+template <typename T>
+struct IsJsonMap : std::false_type
+{};
+
+template <typename T, typename Compare, typename Allocator>
+struct IsJsonMap<std::map<std::string, T, Compare, Allocator>> : std::true_type
+{};
+
+template <typename T>
+constexpr JsonSlotOps makeJsonSlotOps();
+
+template <typename T>
+inline constexpr JsonSlotOps JsonSlotOpsFor = makeJsonSlotOps<T>();
+
+template <typename T>
+JsonSlot jsonSlot( T& value )
+{
+    return JsonSlot{ &value, &JsonSlotOpsFor<T> };
+}
+
+template <typename T, typename Value>
+void storeJsonInteger( void* target, Value value )
+{
+    if ( not std::in_range<T>( value ) )
+        throw std::out_of_range( "Json number " + std::to_string( value ) + " is out of range" );
+    *static_cast<T*>( target ) = static_cast<T>( value );
+}
+
+// Members are matched against the described names; keys the struct does not describe are skipped
+template <typename T>
+JsonSlot findJsonMember( T& value, std::string_view key, size_t& field )
+{
+    JsonSlot slot;
+    size_t index = 0;
+    std::apply(
+        [&]( const auto&... described )
+        { ( ( described.name == key ? ( slot = jsonSlot( value.*described.member ), field = index, void() ) : void(), ++index ), ... ); },
+        T::jsonFields() );
+    return slot;
+}
+
+// Every described member is required, as with the from_json of NLOHMANN_DEFINE_TYPE_INTRUSIVE
+template <typename T>
+void requireJsonMembers( uint64_t seen )
+{
+    size_t index = 0;
+    std::apply(
+        [&]( const auto&... described )
+        {
+            ( ( seen >> index++ & 1 ? void() : throw std::invalid_argument( "Json member " + std::string( described.name ) + " is missing" ) ),
+              ... );
+        },
+        T::jsonFields() );
+}
+
+template <typename T>
+constexpr JsonSlotOps makeJsonSlotOps()
+{
+    JsonSlotOps ops;
+    if constexpr ( std::is_same_v<T, std::string> )
+        ops.string = []( void* target, std::string& value ) { *static_cast<T*>( target ) = std::move( value ); };
+    else if constexpr ( std::is_same_v<T, bool> )
+        ops.boolean = []( void* target, bool value ) { *static_cast<T*>( target ) = value; };
+    else if constexpr ( std::is_integral_v<T> )
+    {
+        ops.integer = &storeJsonInteger<T, int64_t>;
+        ops.unsignedInteger = &storeJsonInteger<T, uint64_t>;
+    }
+    else if constexpr ( JsonDescribed<T> )
+    {
+        static_assert( std::tuple_size_v<decltype( T::jsonFields() )> <= 64, "JsonReader tracks at most 64 members" );
+        ops.member = []( void* target, std::string_view key, size_t& field ) { return findJsonMember( *static_cast<T*>( target ), key, field ); };
+        ops.complete = &requireJsonMembers<T>;
+    }
+    else if constexpr ( IsJsonMap<T>::value )
+        ops.member = []( void* target, std::string_view key, size_t& )
+        { return jsonSlot( ( *static_cast<T*>( target ) )[std::string( key )] ); };
+    else if constexpr ( IsJsonVector<T>::value )
+        ops.element = []( void* target ) { return jsonSlot( static_cast<T*>( target )->emplace_back() ); };
+    else
+        static_assert( sizeof( T ) == 0, "Type cannot be read by JsonReader" );
+    return ops;
+}
+
+// SAX handler decoding a document straight into a described struct, without building a json
+// tree. Works for every input format nlohmann can parse, so cbor and msgpack frames too.
+// A described member missing from the document fails the read, unknown ones are skipped.
+class JsonReader
+{
+    struct Open
+    {
+        JsonSlot slot;
+        uint64_t seen = 0;  // Described members read so far, by index
+    };
+
+    JsonSlot root_;
+    std::vector<Open> open_;  // Objects and arrays being read, innermost last
+    JsonSlot next_;               // Slot of the value following the last key
+    size_t skipped_ = 0;          // Depth inside a skipped object or array
+
+public:
+    explicit JsonReader( JsonSlot root )
+        : root_( root )
+    {}
+
+    bool null()
+    {
+        // Keeps the default, but a struct read as null lacks all of its members
+        if ( skipped_ )
+            return true;
+        const auto slot = nextSlot();
+        if ( slot.ops and slot.ops->complete )
+            slot.ops->complete( 0 );
+        return true;
+    }
+
+    bool boolean( bool value )
+    {
+        return store( &JsonSlotOps::boolean, value );
+    }
+
+    bool number_integer( json::number_integer_t value )
+    {
+        return store( &JsonSlotOps::integer, value );
+    }
+
+    bool number_unsigned( json::number_unsigned_t value )
+    {
+        return store( &JsonSlotOps::unsignedInteger, value );
+    }
+
+    bool number_float( json::number_float_t, const json::string_t& )
+    {
+        return unsupported( "number" );
+    }
+
+    bool string( json::string_t& value )
+    {
+        return store<std::string&>( &JsonSlotOps::string, value );
+    }
+
+    bool binary( json::binary_t& )
+    {
+        return unsupported( "binary" );
+    }
+
+    bool start_object( size_t )
+    {
+        return open( &JsonSlotOps::member, "object" );
+    }
+
+    bool key( json::string_t& key )
+    {
+        if ( not skipped_ )
+        {
+            auto& object = open_.back();
+            size_t field = SIZE_MAX;
+            next_ = object.slot.ops->member( object.slot.target, key, field );
+            if ( field < 64 )
+                object.seen |= uint64_t{ 1 } << field;
+        }
+        return true;
+    }
+
+    bool end_object()
+    {
+        return close();
+    }
+
+    bool start_array( size_t )
+    {
+        return open( &JsonSlotOps::element, "array" );
+    }
+
+    bool end_array()
+    {
+        return close();
+    }
+
+    template <typename Exception>
+    bool parse_error( size_t, const std::string&, const Exception& ex )
+    {
+        throw ex;
+    }
+
+private:
+    // The root, the next element of the innermost array or the value of the last key
+    JsonSlot nextSlot()
+    {
+        if ( open_.empty() )
+            return std::exchange( root_, {} );
+        const auto& container = open_.back().slot;
+        if ( container.ops->element )
+            return container.ops->element( container.target );
+        return std::exchange( next_, {} );
+    }
+
+    template <typename Value, typename Op>
+    bool store( Op JsonSlotOps::*op, Value value )
+    {
+        if ( skipped_ )
+            return true;
+        const auto slot = nextSlot();
+        if ( not slot.ops )
+            return true;
+        if ( not ( slot.ops->*op ) )
+            return mismatch( "value" );
+        ( slot.ops->*op )( slot.target, value );
+        return true;
+    }
+
+    // No struct member takes floats or binary, though skipped values may hold them
+    bool unsupported( const char* kind )
+    {
+        if ( skipped_ or not nextSlot().ops )
+            return true;
+        return mismatch( kind );
+    }
+
+    template <typename Op>
+    bool open( Op JsonSlotOps::*op, const char* kind )
+    {
+        if ( skipped_ )
+        {
+            ++skipped_;
+            return true;
+        }
+        const auto slot = nextSlot();
+        if ( not slot.ops )
+            skipped_ = 1;
+        else if ( not ( slot.ops->*op ) )
+            return mismatch( kind );
+        else
+            open_.push_back( Open{ slot } );
+        return true;
+    }
+
+    bool close()
+    {
+        if ( skipped_ )
+        {
+            --skipped_;
+            return true;
+        }
+        const auto& closed = open_.back();
+        if ( closed.slot.ops->complete )
+            closed.slot.ops->complete( closed.seen );
+        open_.pop_back();
+        return true;
+    }
+
+    static bool mismatch( const char* kind )
+    {
+        throw std::invalid_argument( std::string( "Unexpected json " ) + kind + " for the decoded type" );
+    }
+};
+
+// Events of a value read before the struct it goes into is known, replayed into a JsonReader
+// once it is. A flat list with the strings moved in, so much cheaper than a json tree.
+class JsonTape
+{
+    enum class Event : uint8_t
+    {
+        Null,
+        Boolean,
+        Integer,
+        Unsigned,
+        Float,
+        String,
+        Binary,
+        Key,
+        StartObject,
+        EndObject,
+        StartArray,
+        EndArray
+    };
+
+    struct Entry
+    {
+        Event event;
+        uint64_t number = 0;  // Boolean, integers and the bits of a float
+        std::string text;     // String and Key
+    };
+
+    std::vector<Entry> entries_;
+
+public:
+    bool empty() const
+    {
+        return entries_.empty();
+    }
+
+    bool null()
+    {
+        return add( Event::Null );
+    }
+
+    bool boolean( bool value )
+    {
+        return add( Event::Boolean, value );
+    }
+
+    bool number_integer( json::number_integer_t value )
+    {
+        return add( Event::Integer, static_cast<uint64_t>( value ) );
+    }
+
+    bool number_unsigned( json::number_unsigned_t value )
+    {
+        return add( Event::Unsigned, value );
+    }
+
+    bool number_float( json::number_float_t value, const json::string_t& )
+    {
+        return add( Event::Float, std::bit_cast<uint64_t>( value ) );
+    }
+
+    bool string( json::string_t& value )
+    {
+        entries_.push_back( Entry{ .event = Event::String, .text = std::move( value ) } );
+        return true;
+    }
+
+    bool binary( json::binary_t& )
+    {
+        return add( Event::Binary );
+    }
+
+    bool start_object( size_t )
+    {
+        return add( Event::StartObject );
+    }
+
+    bool key( json::string_t& key )
+    {
+        entries_.push_back( Entry{ .event = Event::Key, .text = std::move( key ) } );
+        return true;
+    }
+
+    bool end_object()
+    {
+        return add( Event::EndObject );
+    }
+
+    bool start_array( size_t )
+    {
+        return add( Event::StartArray );
+    }
+
+    bool end_array()
+    {
+        return add( Event::EndArray );
+    }
+
+    void replay( JsonReader& reader )
+    {
+        json::binary_t binary;
+        for ( auto& entry : entries_ )
+        {
+            switch ( entry.event )
+            {
+                case Event::Null:
+                    reader.null();
+                    break;
+                case Event::Boolean:
+                    reader.boolean( entry.number != 0 );
+                    break;
+                case Event::Integer:
+                    reader.number_integer( static_cast<json::number_integer_t>( entry.number ) );
+                    break;
+                case Event::Unsigned:
+                    reader.number_unsigned( entry.number );
+                    break;
+                case Event::Float:
+                    reader.number_float( std::bit_cast<json::number_float_t>( entry.number ), {} );
+                    break;
+                case Event::String:
+                    reader.string( entry.text );
+                    break;
+                case Event::Binary:
+                    reader.binary( binary );
+                    break;
+                case Event::Key:
+                    reader.key( entry.text );
+                    break;
+                case Event::StartObject:
+                    reader.start_object( 0 );
+                    break;
+                case Event::EndObject:
+                    reader.end_object();
+                    break;
+                case Event::StartArray:
+                    reader.start_array( 0 );
+                    break;
+                case Event::EndArray:
+                    reader.end_array();
+                    break;
+            }
+        }
+    }
+
+private:
+    bool add( Event event, uint64_t number = 0 )
+    {
+        entries_.push_back( Entry{ .event = event, .number = number, .text = {} } );
+        return true;
+    }
+};
+
+// Decodes input of the given format into value, see JsonReader
+template <typename T>
+void readJson( std::string_view input, json::input_format_t format, T& value )
+{
+    JsonReader reader( jsonSlot( value ) );
+    json::sax_parse( input, &reader, format );
+}
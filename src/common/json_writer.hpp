@@ -0,0 +1,244 @@
+#pragma once
+#include <array>
+#include <charconv>
+#include <numeric>
+#include <tuple>
+
+// Pointer to one described member together with its json key
+template <typename Class, typename Member>
+struct JsonField
+{
+    std::string_view name;
+    Member Class::*member;
+};
+
+#define JSON_WRITER_FIELD( field ) JsonField{ #field, &JsonSelf::field },
+
+// NLOHMANN_DEFINE_TYPE_INTRUSIVE that also exposes the field layout to JsonReader and JsonWriter
+#define DEFINE_JSON_TYPE_INTRUSIVE( Type, ... )                                                   \
+    NLOHMANN_DEFINE_TYPE_INTRUSIVE( Type, __VA_ARGS__ )                                          \
+    using JsonSelf = Type;                                                                        \
+    static constexpr auto jsonFields()                                                            \
+    {                                                                                             \
+        return std::tuple{ NLOHMANN_JSON_EXPAND( NLOHMANN_JSON_PASTE( JSON_WRITER_FIELD, __VA_ARGS__ ) ) }; \
+    }
+
+template <typename T>
+concept JsonDescribed = requires { T::jsonFields(); };
+
+// Types producing their own json, e.g. from cached fragments
+template <typename T>
+concept JsonSelfWriting = requires( const T& value, std::string& out ) { value.writeJson( out ); };
+
+template <typename T>
+struct IsJsonVector : std::false_type
+{};
+
+template <typename T, typename Allocator>
+struct IsJsonVector<std::vector<T, Allocator>> : std::true_type
+{};
+
+// Serializes described structs straight into a string, without building a json tree.
+// The output is byte-identical to json( value ).dump(): object keys are emitted in the
+// sorted order of nlohmann's std::map, and strings are escaped the same way.
+class JsonWriter
+{
+    std::string& out_;
+
+public:
+    explicit JsonWriter( std::string& out )
+        : out_( out )
+    {}
+
+    template <typename T>
+    void write( const T& value )
+    {
+        if constexpr ( std::is_same_v<T, std::string> )
+            writeString( value );
+        else if constexpr ( std::is_same_v<T, bool> )
+            out_ += value ? "true" : "false";
+        else if constexpr ( std::is_integral_v<T> )
+            writeInteger( value );
+        else if constexpr ( JsonSelfWriting<T> )
+            value.writeJson( out_ );
+        else if constexpr ( JsonDescribed<T> )
+            writeObject( value );
+        else if constexpr ( IsJsonVector<T>::value )
+            writeArray( value );
+        else
+            out_ += json( value ).dump();
+    }
+
+private:
+    template <typename T>
+    static constexpr auto sortedFieldOrder()
+    {
+        constexpr auto fields = T::jsonFields();
+        constexpr size_t count = std::tuple_size_v<decltype( fields )>;
+
+        const auto names = std::apply(
+            []( const auto&... field ) { return std::array<std::string_view, count>{ field.name... }; }, fields );
+        std::array<size_t, count> order{};
+        std::iota( order.begin(), order.end(), size_t{ 0 } );
+        std::sort( order.begin(), order.end(), [&]( size_t a, size_t b ) { return names[a] < names[b]; } );
+        return order;
+    }
+
+    template <typename T>
+    void writeObject( const T& value )
+    {
+        static constexpr auto fields = T::jsonFields();
+        static constexpr auto order = sortedFieldOrder<T>();
+
+        out_ += '{';
+        [&]<size_t... I>( std::index_sequence<I...> )
+        {
+            ( writeMember( std::get<order[I]>( fields ), value, I == 0 ), ... );
+        }( std::make_index_sequence<order.size()>() );
+        out_ += '}';
+    }
+
+    template <typename Field, typename T>
+    void writeMember( const Field& field, const T& value, bool first )
+    {
+        if ( not first )
+            out_ += ',';
+        out_ += '"';
+        out_ += field.name;
+        out_ += "\":";
+        write( value.*field.member );
+    }
+
+    template <typename T>
+    void writeArray( const T& values )
+    {
+        out_ += '[';
+        bool first = true;
+        for ( const auto& value : values )
+        {
+            if ( not first )
+                out_ += ',';
+            first = false;
+            write( value );
+        }
+        out_ += ']';
+    }
+
+    template <typename T>
+    void writeInteger( T value )
+    {
+        char digits[24];
+        auto [end, _] = std::to_chars( digits, digits + sizeof( digits ), value );
+        out_.append( digits, end );
+    }
+
+    void writeString( const std::string& value )
+    {
+        // nlohmann rejects invalid UTF-8 with its own exception, let it report the error
+        if ( not isValidUtf8( value ) )
+        {
+            out_ += json( value ).dump();
+            return;
+        }
+
+        static constexpr char hex[] = "0123456789abcdef";
+        out_ += '"';
+        for ( const char c : value )
+        {
+            switch ( c )
+            {
+                case '"':
+                    out_ += "\\\"";
+                    break;
+                case '\\':
+                    out_ += "\\\\";
+                    break;
+                case '\b':
+                    out_ += "\\b";
+                    break;
+                case '\f':
+                    out_ += "\\f";
+                    break;
+                case '\n':
+                    out_ += "\\n";
+                    break;
+                case '\r':
+                    out_ += "\\r";
+                    break;
+                case '\t':
+                    out_ += "\\t";
+                    break;
+                default:
+                    if ( static_cast<unsigned char>( c ) < 0x20 )
+                    {
+                        out_ += "\\u00";
+                        out_ += hex[static_cast<unsigned char>( c ) >> 4];
+                        out_ += hex[static_cast<unsigned char>( c ) & 0xF];
+                    }
+                    else
+                        out_ += c;
+                    break;
+            }
+        }
+        out_ += '"';
+    }
+
+    // Strict RFC 3629 check: no overlong forms, surrogates or code points above U+10FFFF
+    static bool isValidUtf8( std::string_view text )
+    {
+        size_t i = 0;
+        while ( i < text.size() )
+        {
+            const auto byte = static_cast<unsigned char>( text[i] );
+            if ( byte < 0x80 )
+            {
+                ++i;
+                continue;
+            }
+
+            size_t length = 0;
+            unsigned char low = 0x80;
+            unsigned char high = 0xBF;
+            if ( byte >= 0xC2 and byte <= 0xDF )
+                length = 2;
+            else if ( byte >= 0xE0 and byte <= 0xEF )
+            {
+                length = 3;
+                low = byte == 0xE0 ? 0xA0 : 0x80;
+                high = byte == 0xED ? 0x9F : 0xBF;
+            }
+            else if ( byte >= 0xF0 and byte <= 0xF4 )
+            {
+                length = 4;
+                low = byte == 0xF0 ? 0x90 : 0x80;
+                high = byte == 0xF4 ? 0x8F : 0xBF;
+            }
+            else
+                return false;
+
+            if ( i + length > text.size() )
+                return false;
+            const auto second = static_cast<unsigned char>( text[i + 1] );
+            if ( second < low or second > high )
+                return false;
+            for ( size_t k = 2; k < length; ++k )
+            {
+                const auto next = static_cast<unsigned char>( text[i + k] );
+                if ( next < 0x80 or next > 0xBF )
+                    return false;
+            }
+            i += length;
+        }
+        return true;
+    }
+};
+
+// Writes into a per-thread scratch buffer, so the output only grows once per thread
+template <typename T>
+std::string writeJson( const T& value )
+{
+    thread_local std::string buffer;
+    buffer.clear();
+    JsonWriter( buffer ).write( value );
+    return buffer;
+}
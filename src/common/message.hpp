@@ -1,11 +1,14 @@
 #pragma once
+#include "json_reader.hpp"
+#include "json_writer.hpp"
+#include "wire_format.hpp"
 #include <magic_enum.hpp>
 
 // Based on metadata choose controller to handle message
 struct Metadata
 {
     std::string type;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE( Metadata, type )
+    DEFINE_JSON_TYPE_INTRUSIVE( Metadata, type )
 };
 
 template <typename T>
@@ -13,15 +16,231 @@ struct Message
 {
     Metadata metadata;
     T data;
+
+    static constexpr auto jsonFields()
+    {
+        return std::tuple{ JsonField{ "metadata", &Message::metadata }, JsonField{ "data", &Message::data } };
+    }
+};
+
+// Only the metadata of a message, its data is skipped when decoding
+struct MessageHeader
+{
+    Metadata metadata;
+    DEFINE_JSON_TYPE_INTRUSIVE( MessageHeader, metadata )
 };
 
 template <typename E, typename T>
-std::string makeMessage( E type, const T& data )
+Message<T> wrapMessage( E type, T data )
 {
     const auto typeName = std::string( magic_enum::enum_name( type ) );
-    const auto metadata = Metadata{ .type = typeName };
-    const auto message = Message<T>{ metadata, data };
-    return json( message ).dump();
+    return Message<T>{ Metadata{ .type = typeName }, std::move( data ) };
+}
+
+// Json is written directly from the structs, binary formats still go through the json tree
+template <typename T>
+std::string encodeMessage( const Message<T>& message, WireFormat format )
+{
+    if ( format == WireFormat::Json )
+        return writeJson( message );
+    return encodeMessage( json( message ), format );
+}
+
+// Decodes straight into the structs, without a json tree, whatever the format
+template <typename T>
+void decodeMessage( std::string_view message, WireFormat format, T& value )
+{
+    readJson( message, inputFormat( format ), value );
+}
+
+// SAX handler reading a message in a single pass, whichever of metadata and data comes first.
+// target is called once with the metadata and returns the slot the data goes into, an empty
+// one skips it. Encoders sort the data in front, so it is taped until the metadata is read.
+template <typename Target>
+class MessageReader
+{
+    Metadata& metadata_;
+    Target& target_;
+    std::optional<JsonReader> member_;  // Reads the value of the current root member
+    JsonTape tape_;                     // Data met before the metadata
+    bool taping_ = false;
+    bool hasData_ = false;
+    bool inMetadata_ = false;
+    bool hasMetadata_ = false;
+    size_t depth_ = 0;
+
+public:
+    MessageReader( Metadata& metadata, Target& target )
+        : metadata_( metadata ),
+          target_( target )
+    {}
+
+    // Decodes the data taped before the metadata; both members are required, as with from_json
+    void finish()
+    {
+        if ( not hasMetadata_ )
+            throw std::invalid_argument( "Json member metadata is missing" );
+        if ( not hasData_ )
+            throw std::invalid_argument( "Json member data is missing" );
+        if ( tape_.empty() )
+            return;
+        JsonReader reader( target_( metadata_ ) );
+        tape_.replay( reader );
+    }
+
+    bool null()
+    {
+        return value( [&]( auto& sink ) { return sink.null(); } );
+    }
+
+    bool boolean( bool value )
+    {
+        return this->value( [&]( auto& sink ) { return sink.boolean( value ); } );
+    }
+
+    bool number_integer( json::number_integer_t value )
+    {
+        return this->value( [&]( auto& sink ) { return sink.number_integer( value ); } );
+    }
+
+    bool number_unsigned( json::number_unsigned_t value )
+    {
+        return this->value( [&]( auto& sink ) { return sink.number_unsigned( value ); } );
+    }
+
+    bool number_float( json::number_float_t value, const json::string_t& text )
+    {
+        return this->value( [&]( auto& sink ) { return sink.number_float( value, text ); } );
+    }
+
+    bool string( json::string_t& value )
+    {
+        return this->value( [&]( auto& sink ) { return sink.string( value ); } );
+    }
+
+    bool binary( json::binary_t& value )
+    {
+        return this->value( [&]( auto& sink ) { return sink.binary( value ); } );
+    }
+
+    bool start_object( size_t size )
+    {
+        // The message itself
+        if ( depth_++ == 0 )
+            return true;
+        return forward( [&]( auto& sink ) { return sink.start_object( size ); } );
+    }
+
+    bool key( json::string_t& key )
+    {
+        if ( depth_ > 1 )
+            return forward( [&]( auto& sink ) { return sink.key( key ); } );
+        beginMember( key );
+        return true;
+    }
+
+    bool end_object()
+    {
+        if ( --depth_ == 0 )
+            return true;
+        return close( [&]( auto& sink ) { return sink.end_object(); } );
+    }
+
+    bool start_array( size_t size )
+    {
+        if ( depth_++ == 0 )
+            notAMessage();
+        return forward( [&]( auto& sink ) { return sink.start_array( size ); } );
+    }
+
+    bool end_array()
+    {
+        --depth_;
+        return close( [&]( auto& sink ) { return sink.end_array(); } );
+    }
+
+    template <typename Exception>
+    bool parse_error( size_t, const std::string&, const Exception& ex )
+    {
+        throw ex;
+    }
+
+private:
+    void beginMember( std::string_view key )
+    {
+        if ( key == "metadata" )
+        {
+            inMetadata_ = true;
+            member_.emplace( jsonSlot( metadata_ ) );
+        }
+        else if ( key == "data" and not hasData_ )
+        {
+            hasData_ = true;
+            if ( hasMetadata_ )
+                member_.emplace( target_( metadata_ ) );
+            else
+                taping_ = true;
+        }
+        else
+            member_.emplace( JsonSlot{} );
+    }
+
+    void endMember()
+    {
+        hasMetadata_ = hasMetadata_ or inMetadata_;
+        inMetadata_ = false;
+        taping_ = false;
+        member_.reset();
+    }
+
+    template <typename Event>
+    bool forward( Event&& event )
+    {
+        if ( taping_ )
+            return event( tape_ );
+        return event( *member_ );
+    }
+
+    // A scalar is a whole member value when it is read at the root
+    template <typename Event>
+    bool value( Event&& event )
+    {
+        if ( depth_ == 0 )
+            notAMessage();
+        const bool result = forward( event );
+        if ( depth_ == 1 )
+            endMember();
+        return result;
+    }
+
+    template <typename Event>
+    bool close( Event&& event )
+    {
+        const bool result = forward( event );
+        if ( depth_ == 1 )
+            endMember();
+        return result;
+    }
+
+    [[noreturn]] static void notAMessage()
+    {
+        throw std::invalid_argument( "Unexpected json value for a message" );
+    }
+};
+
+// Decodes a message in one pass, see MessageReader
+template <typename Target>
+void decodeMessage( std::string_view message, WireFormat format, Metadata& metadata, Target&& target )
+{
+    MessageReader<std::remove_reference_t<Target>> reader( metadata, target );
+    json::sax_parse( message, &reader, inputFormat( format ) );
+    reader.finish();
+}
+
+template <typename E, typename T>
+std::string makeMessage( E type, const T& data, WireFormat format = WireFormat::Json )
+{
+    return encodeMessage( wrapMessage( type, data ), format );
 }
 
 // Specialization for JSON serialization of template class
@@ -1,33 +1,159 @@
 #pragma once
 #include "icontroller.hpp"
+#include "message.hpp"
+#include <array>
 
+// Controllers are indexed by message type in a dense array. Each slot holds typed function
+// pointers for its controller: one creates the request struct a frame is decoded into, the
+// others read its room and call the concrete controller with it, without a virtual hop.
+template <typename EnumType>
 class MessageDispatcher
 {
-    std::unordered_map<std::string, std::shared_ptr<IController>> controllers_;
+public:
+    class Request;
+
+private:
+    static constexpr auto TypeNames = magic_enum::enum_names<EnumType>();
+
+    struct Handler
+    {
+        std::shared_ptr<void> controller;
+        JsonSlot ( *create )( Request& request ) = nullptr;
+        std::optional<std::string> ( *room )( const void* request ) = nullptr;
+        awaitable<void> ( *call )( void* controller, const size_t sessionId, const void* request ) = nullptr;
+    };
+
+    std::array<Handler, TypeNames.size()> handlers_;
 
 public:
+    // A frame decoded into the request struct of its type, ready to be dispatched
+    class Request
+    {
+        friend MessageDispatcher;
+
+        const Handler* handler_ = nullptr;
+        std::unique_ptr<void, void ( * )( void* )> data_{ nullptr, nullptr };
+        std::optional<std::string> room_;
+
+    public:
+        // The room the request names, if its struct has one
+        const std::optional<std::string>& getRoom() const
+        {
+            return room_;
+        }
+    };
+
     MessageDispatcher() = default;
     ~MessageDispatcher() = default;
 
-    template <typename EnumType, typename ControllerType>
+    template <typename ControllerType>
     void addController( EnumType type, ControllerType&& controller )
     {
-        std::string typeName = std::string( magic_enum::enum_name( type ) );
-        if ( controllers_.find( typeName ) != controllers_.end() )
-            throw std::runtime_error( "IController already exists: " + typeName );
-        auto ref = std::make_shared<ControllerType>( std::forward<ControllerType>( controller ) );
-        controllers_.emplace( typeName, std::move( ref ) );
+        using Controller = std::remove_cvref_t<ControllerType>;
+        using Data = typename Controller::RequestType;
+
+        auto& handler = handlers_.at( magic_enum::enum_index( type ).value() );
+        if ( handler.controller )
+            throw std::runtime_error( "IController already exists: " + std::string( magic_enum::enum_name( type ) ) );
+
+        handler.controller = std::make_shared<Controller>( std::forward<ControllerType>( controller ) );
+        handler.create = []( Request& request )
+        {
+            auto* data = new Data();
+            request.data_ = { data, []( void* data ) { delete static_cast<Data*>( data ); } };
+            return jsonSlot( *data );
+        };
+        handler.room = []( const void* request ) -> std::optional<std::string>
+        {
+            if constexpr ( requires { static_cast<const Data*>( request )->room; } )
+                return static_cast<const Data*>( request )->room;
+            return std::nullopt;
+        };
+        // Hands out the controller's own awaitable, so the call adds no coroutine frame
+        handler.call = []( void* controller, const size_t sessionId, const void* request ) -> awaitable<void>
+        {
+            return static_cast<Controller*>( controller )->Controller::call( sessionId, *static_cast<const Data*>( request ) );
+        };
+    }
+
+    // Nothing for a type without a controller. The frame is parsed once: the controller is
+    // looked up as soon as the metadata is read, and the data decoded into its request struct.
+    std::optional<Request> decode( std::string_view frame, WireFormat format ) const
+    {
+        Request request;
+        Metadata metadata;
+        decodeMessage( frame, format, metadata,
+            [&]( const Metadata& metadata ) -> JsonSlot
+            {
+                const auto index = findType( metadata.type );
+                if ( not index or not handlers_[*index].controller )
+                    return {};
+                request.handler_ = &handlers_[*index];
+                return request.handler_->create( request );
+            } );
+
+        if ( not request.handler_ )
+        {
+            std::cerr << "Error: IController not found for type: " << metadata.type << "\n";
+            return std::nullopt;
+        }
+        request.room_ = request.handler_->room( request.data_.get() );
+        return request;
     }
 
-    awaitable<void> dispatch( const size_t sessionId, const json& message )
+    // The request has to outlive the returned awaitable
+    awaitable<void> dispatch( const size_t sessionId, const Request& request ) const
     {
-        std::string name = message.at( "metadata" ).at( "type" ).get<std::string>();
-        json data = message.at( "data" );
+        return request.handler_->call( request.handler_->controller.get(), sessionId, request.data_.get() );
+    }
 
-        auto it = controllers_.find( name );
-        if ( it != controllers_.end() )
-            co_await it->second->call( sessionId, data );
-        else
-            std::cerr << "Error: IController not found for type: " << name << "\n";
+private:
+    // Type names are told apart by their length together with the character at one position,
+    // picked at compile time, so a lookup compares small integers and verifies a single name
+    static constexpr uint32_t typeKey( std::string_view name, size_t position )
+    {
+        if ( name.empty() )
+            return 0;
+        return static_cast<uint32_t>( name.size() << 8 | static_cast<unsigned char>( name[position % name.size()] ) );
+    }
+
+    static constexpr size_t findKeyPosition()
+    {
+        const size_t longest = std::ranges::max( TypeNames, {}, &std::string_view::size ).size();
+        for ( size_t position = 0; position < longest; ++position )
+        {
+            std::array<uint32_t, TypeNames.size()> keys{};
+            for ( size_t i = 0; i < TypeNames.size(); ++i )
+                keys[i] = typeKey( TypeNames[i], position );
+            std::ranges::sort( keys );
+            if ( std::ranges::adjacent_find( keys ) == keys.end() )
+                return position;
+        }
+        throw "Type names cannot be told apart by length and one character";
+    }
+
+    static constexpr size_t KeyPosition = findKeyPosition();
+
+    static constexpr auto TypeKeys = []()
+    {
+        std::array<uint32_t, TypeNames.size()> keys{};
+        for ( size_t i = 0; i < TypeNames.size(); ++i )
+            keys[i] = typeKey( TypeNames[i], KeyPosition );
+        return keys;
+    }();
+
+    static std::optional<size_t> findType( std::string_view name )
+    {
+        const uint32_t key = typeKey( name, KeyPosition );
+        for ( size_t i = 0; i < TypeKeys.size(); ++i )
+        {
+            if ( TypeKeys[i] == key )
+            {
+                if ( TypeNames[i] == name )
+                    return i;
+                break;
+            }
+        }
+        return std::nullopt;
     }
-};
\ No newline at end of file
+};
@@ -1,17 +1,31 @@
 #pragma once
+#include "json_writer.hpp"
 
 enum class ClientMessageType
 {
     InitSession,
     PostUserName,
     PostNewRoom,
-    PostMessage
+    PostMessage,
+    JoinRoom,
+    LeaveRoom,
+    FetchHistory
+};
+
+// Per room, the seq of the first message the client is missing (last seen seq + 1).
+// Rooms left out are sent from their latest page, so a fresh client sends an empty map.
+// The seqs belong to the history of serverId, the server ignores them unless it is its own.
+struct InitSessionRequest
+{
+    uint64_t serverId = 0;
+    std::map<std::string, uint64_t> since;
+    DEFINE_JSON_TYPE_INTRUSIVE( InitSessionRequest, serverId, since )
 };
 
 struct PostRoomRequest
 {
     std::string room;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE( PostRoomRequest, room )
+    DEFINE_JSON_TYPE_INTRUSIVE( PostRoomRequest, room )
 };
 
 struct PostMessageRequest
@@ -19,5 +33,30 @@ struct PostMessageRequest
     std::string user;
     std::string room;
     std::string message;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE( PostMessageRequest, user, room, message )
+    DEFINE_JSON_TYPE_INTRUSIVE( PostMessageRequest, user, room, message )
+};
+
+// Subscribe the session to a room, only subscribers receive its new messages.
+// serverId and since work as in InitSessionRequest, since is 0 when the client holds nothing of the room.
+struct JoinRoomRequest
+{
+    std::string room;
+    uint64_t serverId = 0;
+    uint64_t since = 0;
+    DEFINE_JSON_TYPE_INTRUSIVE( JoinRoomRequest, room, serverId, since )
+};
+
+struct LeaveRoomRequest
+{
+    std::string room;
+    DEFINE_JSON_TYPE_INTRUSIVE( LeaveRoomRequest, room )
+};
+
+// Messages of room with seq below before, at most limit of them (the server caps it further)
+struct FetchHistoryRequest
+{
+    std::string room;
+    uint64_t before = 0;
+    uint64_t limit = 0;
+    DEFINE_JSON_TYPE_INTRUSIVE( FetchHistoryRequest, room, before, limit )
 };
\ No newline at end of file
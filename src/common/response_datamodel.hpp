@@ -3,27 +3,58 @@
 
 enum class ServerMessageType
 {
-    InitSessionResponse,
+    InitSessionResponse,  // Followed by a RoomHistory stream of every room
 
     NewRoom,
-    NewMessage
+    NewMessage,
+    NewMessages,  // Messages of one room posted within the server's batch window, in seq order
+    RoomHistory,  // HistoryPage merged into the client's copy: a joined room, or a piece of an InitSession stream
+    HistoryPage,  // Older page answering FetchHistory, prepended by the client
+
+    // Outbound backlog was coalesced, the client has to request InitSession again
+    ResyncRequired
+};
+
+// A window of a room's history, oldest message first.
+// Messages is a plain list on the client, the server sends a view over its history instead.
+template <typename Messages>
+struct BasicHistoryPage
+{
+    std::string room;
+    Messages messages{};
+    uint64_t cursor = 0;   // Seq of the first message, pass as FetchHistoryRequest::before for the preceding page
+    bool hasMore = false;  // Older messages exist before cursor
+    DEFINE_JSON_TYPE_INTRUSIVE( BasicHistoryPage, room, messages, cursor, hasMore )
 };
 
+using HistoryPage = BasicHistoryPage<std::vector<ChatMessage>>;
+
+// Header of the InitSession stream. Each room's missing messages, capped to the latest page,
+// follow as bounded RoomHistory pieces, oldest first, so the client applies them as they come.
+// A piece that does not continue the client's copy (first seq above since) replaces it.
 struct InitSessionResponse
 {
-    std::vector<ChatRoom> roomsMessages;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE( InitSessionResponse, roomsMessages )
+    uint64_t serverId = 0;  // Identifies the history seqs belong to, a new id invalidates the client's copy
+    std::vector<std::string> rooms;
+    DEFINE_JSON_TYPE_INTRUSIVE( InitSessionResponse, serverId, rooms )
 };
 
 struct NewRoom
 {
     std::string room;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE( NewRoom, room )
+    DEFINE_JSON_TYPE_INTRUSIVE( NewRoom, room )
 };
 
 struct NewMessage
 {
     std::string room;
     ChatMessage chatMessage;
-    NLOHMANN_DEFINE_TYPE_INTRUSIVE( NewMessage, room, chatMessage )
-};
\ No newline at end of file
+    DEFINE_JSON_TYPE_INTRUSIVE( NewMessage, room, chatMessage )
+};
+
+struct NewMessages
+{
+    std::string room;
+    std::vector<ChatMessage> chatMessages;
+    DEFINE_JSON_TYPE_INTRUSIVE( NewMessages, room, chatMessages )
+};
@@ -0,0 +1,86 @@
+#pragma once
+#include <optional>
+
+// Encoding of every frame on a connection, negotiated through Sec-WebSocket-Protocol.
+// Json is used when the client offers no known subprotocol.
+enum class WireFormat
+{
+    Json,
+    Cbor,
+    MsgPack
+};
+
+inline std::string_view wireFormatProtocol( WireFormat format )
+{
+    switch ( format )
+    {
+        case WireFormat::Cbor:
+            return "chat.cbor";
+        case WireFormat::MsgPack:
+            return "chat.msgpack";
+        default:
+            return "chat.json";
+    }
+}
+
+// Picks the first supported entry of a comma separated subprotocol list
+inline std::optional<WireFormat> negotiateWireFormat( std::string_view offered )
+{
+    for ( auto part : offered | std::views::split( ',' ) )
+    {
+        auto protocol = std::string_view( part.begin(), part.end() );
+        while ( not protocol.empty() and protocol.front() == ' ' )
+            protocol.remove_prefix( 1 );
+        while ( not protocol.empty() and protocol.back() == ' ' )
+            protocol.remove_suffix( 1 );
+
+        for ( auto format : { WireFormat::Json, WireFormat::Cbor, WireFormat::MsgPack } )
+            if ( protocol == wireFormatProtocol( format ) )
+                return format;
+    }
+    return std::nullopt;
+}
+
+inline json::input_format_t inputFormat( WireFormat format )
+{
+    switch ( format )
+    {
+        case WireFormat::Cbor:
+            return json::input_format_t::cbor;
+        case WireFormat::MsgPack:
+            return json::input_format_t::msgpack;
+        default:
+            return json::input_format_t::json;
+    }
+}
+
+inline std::string encodeMessage( const json& message, WireFormat format )
+{
+    std::string encoded;
+    switch ( format )
+    {
+        case WireFormat::Cbor:
+            json::to_cbor( message, encoded );
+            break;
+        case WireFormat::MsgPack:
+            json::to_msgpack( message, encoded );
+            break;
+        default:
+            encoded = message.dump();
+            break;
+    }
+    return encoded;
+}
+
+inline json decodeMessage( std::string_view message, WireFormat format )
+{
+    switch ( format )
+    {
+        case WireFormat::Cbor:
+            return json::from_cbor( message );
+        case WireFormat::MsgPack:
+            return json::from_msgpack( message );
+        default:
+            return json::parse( message );
+    }
+}
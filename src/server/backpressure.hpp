@@ -0,0 +1,50 @@
+#pragma once
+
+// What a session does when its outbound queue crosses the high-water mark
+enum class OverflowPolicy
+{
+    DropOldest,  // Discard queued frames from the front until the new one fits
+    DropNew,     // Discard the frame being sent
+    Coalesce,    // Replace the whole backlog with a single ResyncRequired frame
+    Disconnect   // Drop the connection
+};
+
+struct SessionOptions
+{
+    size_t maxQueuedMessages = 1024;
+    size_t maxQueuedBytes = 4 * 1024 * 1024;
+    OverflowPolicy overflowPolicy = OverflowPolicy::DropOldest;
+    size_t maxInboundMessages = 64;  // Decoded requests a session buffers before it stops reading
+    size_t inboundWorkers = 1;       // Requests of a session processed concurrently, ordered per room
+    size_t maxCoalescedBytes = 64 * 1024;  // Queued frames sent with one socket write, 0 writes each on its own
+};
+
+// How often each policy was triggered, shared by all sessions of a server
+struct BackpressureStats
+{
+    std::atomic<uint64_t> droppedOldest{ 0 };
+    std::atomic<uint64_t> droppedNew{ 0 };
+    std::atomic<uint64_t> coalesced{ 0 };
+    std::atomic<uint64_t> disconnected{ 0 };
+
+    void print( std::ostream& out ) const
+    {
+        out << "Info: Backpressure stats: dropped oldest " << droppedOldest
+            << ", dropped new " << droppedNew
+            << ", coalesced " << coalesced
+            << ", disconnected " << disconnected << "\n";
+    }
+};
+
+// How many frames the session writers sent in how many socket writes, shared by all sessions
+struct WriteStats
+{
+    std::atomic<uint64_t> frames{ 0 };
+    std::atomic<uint64_t> socketWrites{ 0 };
+
+    void print( std::ostream& out ) const
+    {
+        out << "Info: Write stats: " << frames << " frames in " << socketWrites << " socket writes ("
+            << ( socketWrites ? static_cast<double>( frames ) / socketWrites : 0.0 ) << " frames per write)\n";
+    }
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+// Stream layer under the websocket that can hold back writes: while corked, every write is
+// copied into a pending buffer and completes at once. The first write after the cork is
+// lifted sends the pending bytes and its own in a single gather write, so several frames
+// cost one syscall. Reads pass straight through.
+template <typename NextLayer>
+class CoalescingStream
+{
+    NextLayer next_;
+    beast::flat_buffer pending_;
+    bool corked_ = false;
+    uint64_t socketWrites_ = 0;
+
+public:
+    using executor_type = typename NextLayer::executor_type;
+
+    explicit CoalescingStream( NextLayer next )
+        : next_( std::move( next ) )
+    {}
+
+    executor_type get_executor() noexcept
+    {
+        return next_.get_executor();
+    }
+
+    NextLayer& next_layer() noexcept
+    {
+        return next_;
+    }
+
+    const NextLayer& next_layer() const noexcept
+    {
+        return next_;
+    }
+
+    // Only takes effect for the writes started after it, lift it before the last frame of a burst
+    void cork( bool corked )
+    {
+        corked_ = corked;
+    }
+
+    // Writes that reached the next layer
+    uint64_t getSocketWrites() const
+    {
+        return socketWrites_;
+    }
+
+    template <typename MutableBufferSequence>
+    size_t read_some( const MutableBufferSequence& buffers, boost::system::error_code& ec )
+    {
+        return next_.read_some( buffers, ec );
+    }
+
+    template <typename MutableBufferSequence>
+    size_t read_some( const MutableBufferSequence& buffers )
+    {
+        return next_.read_some( buffers );
+    }
+
+    template <typename MutableBufferSequence, typename ReadToken>
+    auto async_read_some( const MutableBufferSequence& buffers, ReadToken&& token )
+    {
+        return next_.async_read_some( buffers, std::forward<ReadToken>( token ) );
+    }
+
+    // Synchronous writes, e.g. the close frame, never wait behind the cork
+    template <typename ConstBufferSequence>
+    size_t write_some( const ConstBufferSequence& buffers, boost::system::error_code& ec )
+    {
+        const size_t size = asio::buffer_size( buffers );
+        ++socketWrites_;
+        asio::write( next_, beast::buffers_cat( pending_.data(), buffers ), ec );
+        pending_.consume( pending_.size() );
+        return ec ? 0 : size;
+    }
+
+    template <typename ConstBufferSequence>
+    size_t write_some( const ConstBufferSequence& buffers )
+    {
+        boost::system::error_code ec;
+        const size_t size = write_some( buffers, ec );
+        if ( ec )
+            throw boost::system::system_error( ec );
+        return size;
+    }
+
+    template <typename ConstBufferSequence, typename WriteToken>
+    auto async_write_some( const ConstBufferSequence& buffers, WriteToken&& token )
+    {
+        return asio::async_initiate<WriteToken, void( boost::system::error_code, size_t )>(
+            [this]( auto handler, const ConstBufferSequence& buffers )
+            {
+                const size_t size = asio::buffer_size( buffers );
+                auto executor = asio::get_associated_executor( handler, get_executor() );
+                if ( corked_ )
+                {
+                    // The caller may reuse its buffers once this completes, so they are copied
+                    pending_.commit( asio::buffer_copy( pending_.prepare( size ), buffers ) );
+                    asio::post( executor, [handler = std::move( handler ), size]() mutable { handler( {}, size ); } );
+                    return;
+                }
+
+                ++socketWrites_;
+                if ( pending_.size() == 0 )
+                {
+                    next_.async_write_some( buffers, std::move( handler ) );
+                    return;
+                }
+
+                asio::async_write( next_, beast::buffers_cat( pending_.data(), buffers ),
+                    asio::bind_executor( executor,
+                        [this, handler = std::move( handler ), size]( boost::system::error_code ec, size_t ) mutable
+                        {
+                            pending_.consume( pending_.size() );
+                            handler( ec, ec ? 0 : size );
+                        } ) );
+            },
+            token, buffers );
+    }
+
+    // Found by the websocket through ADL to shut the connection down
+    friend void teardown( beast::role_type role, CoalescingStream& stream, boost::system::error_code& ec )
+    {
+        using beast::websocket::teardown;
+        teardown( role, stream.next_, ec );
+    }
+
+    template <typename TeardownHandler>
+    friend void async_teardown( beast::role_type role, CoalescingStream& stream, TeardownHandler&& handler )
+    {
+        using beast::websocket::async_teardown;
+        async_teardown( role, stream.next_, std::forward<TeardownHandler>( handler ) );
+    }
+};
@@ -0,0 +1,448 @@
+#pragma once
+#include "common/helpers.hpp"
+#include "message_store.hpp"
+#include <boost/beast/zlib/deflate_stream.hpp>
+#include <boost/beast/zlib/inflate_stream.hpp>
+#include <cstddef>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <map>
+#include <optional>
+#include <unistd.h>
+#include <zlib.h>
+
+// How often history reads were served by the hot tier alone, shared by all rooms
+struct TierStats
+{
+    std::atomic<uint64_t> hotReads{ 0 };
+    std::atomic<uint64_t> coldReads{ 0 };     // Reads that reached past the hot tier
+    std::atomic<uint64_t> coldMessages{ 0 };  // Messages those reads got from the cold tier
+    std::atomic<uint64_t> evictedMessages{ 0 };
+    std::atomic<uint64_t> evictedBytes{ 0 };  // Compressed size on disk
+
+    void print( std::ostream& out ) const
+    {
+        const uint64_t reads = hotReads + coldReads;
+        out << "Info: Tier stats: hot hit ratio " << ( reads ? 100.0 * hotReads / reads : 100.0 ) << "% of " << reads
+            << " reads, " << coldMessages << " messages read from disk, " << evictedMessages << " messages evicted into "
+            << evictedBytes << " compressed bytes\n";
+    }
+};
+
+// Cold tier of the room histories: chunks evicted from memory, each deflated into one block
+// of an append-only file per room. Block headers are indexed in memory, so a read only
+// loads and inflates the blocks overlapping the requested seqs.
+class ColdStore
+{
+    struct BlockHeader
+    {
+        uint64_t firstSeq;
+        uint32_t count;
+        uint32_t rawSize;
+        uint32_t size;  // Compressed
+        uint32_t crc;   // Of the fields above and the compressed bytes
+    };
+    static_assert( offsetof( BlockHeader, crc ) + sizeof( BlockHeader::crc ) == sizeof( BlockHeader ) );
+
+    static constexpr std::string_view Extension = ".cold";
+
+    // Opened for a single write, sync or read, so rooms hold no descriptors in between
+    struct File
+    {
+        int fd;
+
+        File( const std::filesystem::path& path, int flags )
+            : fd( ::open( path.c_str(), flags | O_CLOEXEC, 0644 ) )
+        {}
+
+        ~File()
+        {
+            if ( fd >= 0 )
+                ::close( fd );
+        }
+
+        File( const File& ) = delete;
+        File& operator=( const File& ) = delete;
+    };
+
+public:
+    class Room
+    {
+        friend class ColdStore;
+
+        struct Block
+        {
+            BlockHeader header;
+            uint64_t offset;  // Of the compressed bytes
+        };
+
+        std::filesystem::path path_;  // Created by the first block written
+        mutable std::mutex mutex_;
+        std::vector<Block> blocks_;                        // By seq
+        std::map<uint64_t, MessageStore::Range> pending_;  // Evicted but not written yet, by first seq
+        uint64_t fileSize_ = 0;
+        uint64_t endSeq_ = 0;  // Everything below is written or pending
+        bool dirty_ = false;   // Written since the last sync
+        bool failed_ = false;  // A block write failed, the later ones stay pending behind it
+
+    public:
+        Room() = default;
+
+        Room( const Room& ) = delete;
+        Room& operator=( const Room& ) = delete;
+
+        // Seq of the oldest message on the cold tier, if it holds any
+        std::optional<uint64_t> firstSeq() const
+        {
+            std::lock_guard lock( mutex_ );
+            std::optional<uint64_t> first;
+            if ( not blocks_.empty() )
+                first = blocks_.front().header.firstSeq;
+            if ( not pending_.empty() )
+                first = std::min( first.value_or( UINT64_MAX ), pending_.begin()->second.from() );
+            return first;
+        }
+    };
+
+private:
+    std::filesystem::path directory_;
+    asio::thread_pool pool_{ 2 };                                  // Disk reads, compression and writes
+    asio::strand<asio::thread_pool::executor_type> writer_;       // Keeps the blocks of a room in order
+    std::mutex mutex_;
+    std::unordered_map<std::string, std::shared_ptr<Room>> rooms_;
+    TierStats stats_;
+
+public:
+    // Indexes the blocks already in directory. A torn block at the end of a file is cut off.
+    explicit ColdStore( std::filesystem::path directory )
+        : directory_( std::move( directory ) ),
+          writer_( asio::make_strand( pool_ ) )
+    {
+        std::filesystem::create_directories( directory_ );
+        for ( const auto& file : std::filesystem::directory_iterator( directory_ ) )
+        {
+            if ( file.path().extension() != Extension )
+                continue;
+            auto room = openRoom( file.path() );
+            rooms_.emplace( decodeName( file.path().stem().string() ), std::move( room ) );
+        }
+    }
+
+    // Finishes the writes still queued
+    ~ColdStore()
+    {
+        pool_.join();
+    }
+
+    TierStats& getStats()
+    {
+        return stats_;
+    }
+
+    std::shared_ptr<Room> getRoom( const std::string& name )
+    {
+        std::lock_guard lock( mutex_ );
+        auto& room = rooms_[name];
+        if ( not room )
+        {
+            room = std::make_shared<Room>();
+            room->path_ = directory_ / ( encodeName( name ) + std::string( Extension ) );
+        }
+        return room;
+    }
+
+    // Takes over a chunk trimmed from the hot tier. It stays readable from memory until
+    // its block is written. Seqs the room already holds are skipped, as when the log is replayed.
+    void evict( const std::shared_ptr<Room>& room, MessageStore::Range range )
+    {
+        {
+            std::lock_guard lock( room->mutex_ );
+            if ( range.to() <= room->endSeq_ )
+                return;
+            range = range.slice( room->endSeq_, range.to() );
+            room->endSeq_ = range.to();
+            room->pending_.emplace( range.from(), range );
+        }
+        stats_.evictedMessages += range.size();
+
+        asio::post( writer_,
+            [this, room, range = std::move( range )]()
+            {
+                auto block = compress( range );
+                std::lock_guard lock( room->mutex_ );
+                // Blocks are kept in seq order, so after a failure they wait for the retry in sync
+                if ( room->failed_ or not room->pending_.contains( range.from() ) )
+                    return;
+                if ( not write( *room, std::move( block ), range.from(), static_cast<uint32_t>( range.size() ) ) )
+                {
+                    room->failed_ = true;
+                    return;
+                }
+                room->pending_.erase( range.from() );
+            } );
+    }
+
+    // Makes every block written so far durable. Fails while a room has chunks whose writes
+    // failed, they are retried first: they only live in memory and must stay in the log.
+    awaitable<void> sync()
+    {
+        co_await runOn( writer_,
+            [this]()
+            {
+                std::lock_guard lock( mutex_ );
+                size_t failed = 0;
+                for ( auto& [_, room] : rooms_ )
+                {
+                    std::lock_guard roomLock( room->mutex_ );
+                    if ( room->failed_ and not retry( *room ) )
+                        ++failed;
+                    if ( not room->dirty_ )
+                        continue;
+                    // Flushes the file whichever descriptor wrote it
+                    const File file( room->path_, O_WRONLY );
+                    if ( file.fd < 0 or ::fdatasync( file.fd ) != 0 )
+                        throw std::runtime_error( std::string( "Cold store fdatasync failed: " ) + std::strerror( errno ) );
+                    room->dirty_ = false;
+                }
+                if ( failed )
+                    throw std::runtime_error( "Cold store writes failed in " + std::to_string( failed ) + " rooms" );
+            } );
+    }
+
+    // Messages with seq in [from, to) held by the cold tier, oldest first
+    awaitable<std::vector<ChatMessage>> read( std::shared_ptr<Room> room, uint64_t from, uint64_t to )
+    {
+        stats_.coldReads++;
+        auto messages = co_await runOn( pool_.get_executor(),
+            [&]()
+            {
+                std::vector<Room::Block> blocks;
+                std::vector<MessageStore::Range> pending;
+                {
+                    std::lock_guard lock( room->mutex_ );
+                    for ( const auto& block : room->blocks_ )
+                        if ( block.header.firstSeq < to and block.header.firstSeq + block.header.count > from )
+                            blocks.push_back( block );
+                    for ( const auto& [_, range] : room->pending_ )
+                        if ( range.from() < to and range.to() > from )
+                            pending.push_back( range.slice( from, to ) );
+                }
+
+                std::vector<ChatMessage> messages;
+                if ( not blocks.empty() )
+                {
+                    const File file( room->path_, O_RDONLY );
+                    if ( file.fd < 0 )
+                        throw std::runtime_error( "Can't open " + room->path_.string() + ": " + std::strerror( errno ) );
+                    for ( const auto& block : blocks )
+                        readBlock( file.fd, block, from, to, messages );
+                }
+                for ( const auto& range : pending )
+                    std::ranges::move( range.read(), std::back_inserter( messages ) );
+                std::ranges::sort( messages, {}, &ChatMessage::seq );
+                return messages;
+            } );
+        stats_.coldMessages += messages.size();
+        co_return messages;
+    }
+
+private:
+    // Hex of the room name, so any name makes a valid file name
+    static std::string encodeName( std::string_view name )
+    {
+        static constexpr char hex[] = "0123456789abcdef";
+        std::string encoded;
+        for ( const char c : name )
+        {
+            encoded += hex[static_cast<unsigned char>( c ) >> 4];
+            encoded += hex[static_cast<unsigned char>( c ) & 0xF];
+        }
+        return encoded;
+    }
+
+    static std::string decodeName( std::string_view encoded )
+    {
+        std::string name;
+        for ( size_t i = 0; i + 1 < encoded.size(); i += 2 )
+            name += static_cast<char>( std::stoi( std::string( encoded.substr( i, 2 ) ), nullptr, 16 ) );
+        return name;
+    }
+
+    static std::shared_ptr<Room> openRoom( const std::filesystem::path& path )
+    {
+        auto room = std::make_shared<Room>();
+        room->path_ = path;
+        const File file( path, O_RDWR );
+        if ( file.fd < 0 )
+            throw std::runtime_error( "Can't open " + path.string() + ": " + std::strerror( errno ) );
+
+        const auto size = static_cast<uint64_t>( ::lseek( file.fd, 0, SEEK_END ) );
+        uint64_t offset = 0;
+        BlockHeader header;
+        while ( size - offset >= sizeof( header ) and
+                ::pread( file.fd, &header, sizeof( header ), static_cast<off_t>( offset ) ) == sizeof( header ) and
+                header.count > 0 and header.size <= size - offset - sizeof( header ) and header.firstSeq >= room->endSeq_ )
+        {
+            room->blocks_.push_back( Room::Block{ header, offset + sizeof( header ) } );
+            room->endSeq_ = header.firstSeq + header.count;
+            offset += sizeof( header ) + header.size;
+        }
+        if ( offset != size )
+        {
+            std::cerr << "Error: Dropping " << size - offset << " torn bytes at the end of " << path.string() << "\n";
+            if ( ::ftruncate( file.fd, static_cast<off_t>( offset ) ) != 0 )
+                throw std::runtime_error( "Can't truncate " + path.string() + ": " + std::strerror( errno ) );
+        }
+        room->fileSize_ = offset;
+        return room;
+    }
+
+    // Block layout per message: timestamp, sender size, content size, sender, content
+    static std::string compress( const MessageStore::Range& range )
+    {
+        std::string raw;
+        range.visit(
+            [&]( uint64_t, int64_t timestamp, std::string_view sender, std::string_view content )
+            {
+                const uint32_t sizes[] = { static_cast<uint32_t>( sender.size() ), static_cast<uint32_t>( content.size() ) };
+                raw.append( reinterpret_cast<const char*>( &timestamp ), sizeof( timestamp ) );
+                raw.append( reinterpret_cast<const char*>( sizes ), sizeof( sizes ) );
+                raw += sender;
+                raw += content;
+            } );
+
+        beast::zlib::deflate_stream stream;
+        std::string block( sizeof( BlockHeader ) + stream.upper_bound( raw.size() ), '\0' );
+        beast::zlib::z_params params;
+        params.next_in = raw.data();
+        params.avail_in = raw.size();
+        params.next_out = block.data() + sizeof( BlockHeader );
+        params.avail_out = block.size() - sizeof( BlockHeader );
+        boost::system::error_code ec;
+        stream.write( params, beast::zlib::Flush::finish, ec );
+        if ( ec != beast::zlib::error::end_of_stream )
+            throw std::runtime_error( "Cold store deflate failed: " + ec.message() );
+        block.resize( sizeof( BlockHeader ) + params.total_out );
+
+        // firstSeq, count and crc are filled in when the block is written
+        const BlockHeader header{ .firstSeq = 0,
+                                  .count = 0,
+                                  .rawSize = static_cast<uint32_t>( raw.size() ),
+                                  .size = static_cast<uint32_t>( params.total_out ),
+                                  .crc = 0 };
+        std::memcpy( block.data(), &header, sizeof( header ) );
+        return block;
+    }
+
+    // Writes the room's pending chunks in seq order, called on the writer strand with the room locked
+    bool retry( Room& room )
+    {
+        while ( not room.pending_.empty() )
+        {
+            const auto& range = room.pending_.begin()->second;
+            if ( not write( room, compress( range ), range.from(), static_cast<uint32_t>( range.size() ) ) )
+                return false;
+            room.pending_.erase( room.pending_.begin() );
+        }
+        room.failed_ = false;
+        return true;
+    }
+
+    // Called on the writer strand with the room locked
+    bool write( Room& room, std::string block, uint64_t firstSeq, uint32_t count )
+    {
+        BlockHeader header;
+        std::memcpy( &header, block.data(), sizeof( header ) );
+        header.firstSeq = firstSeq;
+        header.count = count;
+        header.crc = blockCrc( header, block.data() + sizeof( header ) );
+        std::memcpy( block.data(), &header, sizeof( header ) );
+
+        const File file( room.path_, O_WRONLY | O_CREAT | O_APPEND );
+        if ( file.fd < 0 )
+        {
+            std::cerr << "Error: Cold store open failed: " << std::strerror( errno ) << "\n";
+            return false;
+        }
+
+        size_t written = 0;
+        while ( written < block.size() )
+        {
+            const ssize_t result = ::write( file.fd, block.data() + written, block.size() - written );
+            if ( result < 0 and errno == EINTR )
+                continue;
+            if ( result < 0 )
+            {
+                // The messages stay pending in memory, so reads keep working
+                std::cerr << "Error: Cold store write failed: " << std::strerror( errno ) << "\n";
+                if ( written and ::ftruncate( file.fd, static_cast<off_t>( room.fileSize_ ) ) != 0 )
+                    std::cerr << "Error: Cold store truncate failed: " << std::strerror( errno ) << "\n";
+                return false;
+            }
+            written += static_cast<size_t>( result );
+        }
+
+        room.blocks_.push_back( Room::Block{ header, room.fileSize_ + sizeof( header ) } );
+        room.fileSize_ += block.size();
+        room.dirty_ = true;
+        stats_.evictedBytes += block.size();
+        return true;
+    }
+
+    // The header is covered too, so its counts and sizes can be trusted once the crc matches
+    static uint32_t blockCrc( const BlockHeader& header, const char* compressed )
+    {
+        const auto crc = crc32_z( 0, reinterpret_cast<const Bytef*>( &header ), offsetof( BlockHeader, crc ) );
+        return static_cast<uint32_t>( crc32_z( crc, reinterpret_cast<const Bytef*>( compressed ), header.size ) );
+    }
+
+    static void readBlock( int fd, const Room::Block& block, uint64_t from, uint64_t to, std::vector<ChatMessage>& messages )
+    {
+        const auto& header = block.header;
+        const auto corrupt = [&]() { return std::runtime_error( "Corrupt cold block at seq " + std::to_string( header.firstSeq ) ); };
+
+        std::string compressed( header.size, '\0' );
+        if ( ::pread( fd, compressed.data(), compressed.size(), static_cast<off_t>( block.offset ) ) !=
+                 static_cast<ssize_t>( compressed.size() ) or
+             blockCrc( header, compressed.data() ) != header.crc )
+            throw corrupt();
+
+        std::string raw( header.rawSize, '\0' );
+        beast::zlib::inflate_stream stream;
+        beast::zlib::z_params params;
+        params.next_in = compressed.data();
+        params.avail_in = compressed.size();
+        params.next_out = raw.data();
+        params.avail_out = raw.size();
+        boost::system::error_code ec;
+        stream.write( params, beast::zlib::Flush::finish, ec );
+        // Stops once the output is full, which may be just before the end of the stream
+        if ( params.total_out != raw.size() )
+            throw std::runtime_error( "Cold store inflate failed: " + ec.message() );
+
+        // Every record has to lie within the block, and together they have to fill it exactly
+        const char* data = raw.data();
+        const char* const end = data + raw.size();
+        for ( uint64_t seq = header.firstSeq; seq < header.firstSeq + header.count; ++seq )
+        {
+            int64_t timestamp;
+            uint32_t sizes[2];
+            if ( static_cast<size_t>( end - data ) < sizeof( timestamp ) + sizeof( sizes ) )
+                throw corrupt();
+            std::memcpy( &timestamp, data, sizeof( timestamp ) );
+            std::memcpy( sizes, data + sizeof( timestamp ), sizeof( sizes ) );
+            data += sizeof( timestamp ) + sizeof( sizes );
+            if ( uint64_t{ sizes[0] } + sizes[1] > static_cast<size_t>( end - data ) )
+                throw corrupt();
+            if ( seq >= from and seq < to )
+                messages.push_back( ChatMessage{ .seq = seq,
+                                                 .sender = std::string( data, sizes[0] ),
+                                                 .content = std::string( data + sizes[0], sizes[1] ),
+                                                 .timestamp = timestamp } );
+            data += sizes[0] + sizes[1];
+        }
+        if ( data != end )
+            throw corrupt();
+    }
+};
@@ -1,65 +1,355 @@
 #pragma once
 #include "common/datamodel.hpp"
+#include "common/helpers.hpp"
+#include "common/response_datamodel.hpp"
+#include "cold_store.hpp"
+#include "message_log.hpp"
+#include "message_store.hpp"
+#include "room_shards.hpp"
+#include <random>
 
-// In memmory database for example purposes
+// Pages reference a snapshot of the room instead of copying the messages out of it
+using HistoryPageView = BasicHistoryPage<MessageStore::Range>;
+
+// In memmory database, optionally backed by an append-only log that is replayed on startup.
+// With a log and a hot window, only each room's recent history stays in memory and older
+// messages move to compressed files on disk, from where pages reaching back that far are read.
+// Every room has its own strand, so rooms never wait on each other.
+// The room directory is sharded by room and copy-on-write: lookups load a snapshot without
+// any locking, and creating a room only copies and serializes with the rooms of its shard.
 class Database
 {
+    struct Room
+    {
+        asio::strand<asio::io_context::executor_type> strand;
+        MessageStore messages;  // Only touched on strand, readers work on its snapshots
+        std::shared_ptr<ColdStore::Room> cold;  // History evicted from messages, when tiered
+    };
+
+    using RoomMap = std::unordered_map<std::string, std::shared_ptr<Room>>;
+
+    struct Directory
+    {
+        std::atomic<std::shared_ptr<const RoomMap>> rooms{ std::make_shared<const RoomMap>() };
+    };
+
     asio::io_context& ioContext_;
-    asio::strand<asio::io_context::executor_type> strand_;
-    std::unordered_map<std::string, ChatRoom> chatRooms_;
+    RetentionOptions retention_;
+    RoomShards<Directory> directory_;  // Room creation is serialized on the room's shard
+    std::unique_ptr<MessageLog> log_;
+    std::unique_ptr<ColdStore> cold_;
+    bool asyncCommit_ = false;
+    PersistenceStats stats_;
+    // Seqs are only meaningful together with this id, it is kept in the log when there is one
+    uint64_t instanceId_ = std::mt19937_64( std::random_device{}() )();
 
 public:
-    Database( asio::io_context& ioContext ) 
+    // A hot window only takes effect with a log. It then replaces retention, as the cold tier keeps all history
+    Database( asio::io_context& ioContext, const RetentionOptions& retention = {}, const LogOptions& log = {},
+              const RetentionOptions& hot = {}, size_t shards = 1 )
         : ioContext_( ioContext ),
-          strand_( asio::make_strand( ioContext ) )
-    {}
+          retention_( retention ),
+          directory_( ioContext, shards ),
+          asyncCommit_( log.asyncCommit )
+    {
+        if ( log.directory.empty() )
+            return;
+        log_ = std::make_unique<MessageLog>( log );
+        if ( hot.maxMessages or hot.maxBytes )
+        {
+            retention_ = hot;
+            cold_ = std::make_unique<ColdStore>( std::filesystem::path( log.directory ) / "cold" );
+        }
+        recover();
+        log_->open( instanceId_ );
+        if ( log.checkpointSeconds )
+            asio::co_spawn( ioContext_, checkpointLoop( std::chrono::seconds( log.checkpointSeconds ) ), asio::detached );
+    }
     ~Database() = default;
 
-    awaitable<void> addMessage( const std::string& room, const ChatMessage& msg )
+    uint64_t getInstanceId() const
+    {
+        return instanceId_;
+    }
+
+    const PersistenceStats& getPersistenceStats() const
+    {
+        return stats_;
+    }
+
+    // Nothing when history is not tiered
+    const TierStats* getTierStats() const
+    {
+        return cold_ ? &cold_->getStats() : nullptr;
+    }
+
+    // Writes every room's retained history into a checkpoint, after which recovery only replays
+    // the log from this point on. Rooms are snapshotted in O(1), so appends never wait for it.
+    // When tiered, the checkpoint only holds the hot tiers and the cold files are synced before it.
+    awaitable<void> checkpoint()
     {
-        co_await asio::post( asio::bind_executor( strand_, asio::use_awaitable ) );
+        const auto start = std::chrono::steady_clock::now();
+        // Every record in the segments below is part of the snapshots taken after this
+        const uint64_t segment = co_await log_->rotate();
 
-        auto it = chatRooms_.find( room );
-        if ( it != chatRooms_.end() )
-            it->second.messages.push_back( msg );
+        std::vector<std::pair<std::string, MessageStore::Range>> snapshots;
+        for ( const auto& [name, room] : getRooms() )
+        {
+            auto messages = co_await runOn( room->strand, [&]() { return room->messages.snapshot().range( 0, UINT64_MAX ); } );
+            snapshots.emplace_back( name, std::move( messages ) );
+        }
+        // Everything evicted before the snapshots is queued ahead of the sync
+        if ( cold_ )
+            co_await cold_->sync();
+
+        const auto totals = co_await log_->writeCheckpoint( segment,
+            [&]( MessageLog::Checkpoint& checkpoint )
+            {
+                for ( const auto& [name, messages] : snapshots )
+                {
+                    checkpoint.addRoom( name, messages.from() );
+                    messages.visit(
+                        [&]( uint64_t seq, int64_t timestamp, std::string_view sender, std::string_view content )
+                        { checkpoint.addMessage( name, seq, timestamp, sender, content ); } );
+                }
+            } );
+
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - start );
+        ++stats_.checkpoints;
+        stats_.lastCheckpointMillis = elapsed.count();
+        stats_.lastCheckpointMessages = totals.messages;
+        stats_.lastCheckpointBytes = totals.bytes;
+        std::cout << "Info: Checkpoint of " << totals.rooms << " rooms and " << totals.messages << " messages, "
+                  << totals.bytes << " bytes in " << elapsed.count() << " ms\n";
+    }
+
+    // Stores msg under the room's next seq, returns the stored copy or nothing if the room is unknown
+    // With a log, resumes once the message is committed unless commits are async
+    awaitable<std::optional<ChatMessage>> addMessage( const std::string& room, const ChatMessage& msg )
+    {
+        auto shard = findRoom( room );
+        if ( not shard )
+            co_return std::nullopt;
+
+        // Logged on the room's strand, so the log holds every room's messages in seq order
+        uint64_t ticket = 0;
+        auto stored = co_await runOn( shard->strand,
+            [&]()
+            {
+                auto message = shard->messages.append( msg.sender, msg.content, msg.timestamp );
+                if ( log_ )
+                    ticket = log_->appendMessage( room, message );
+                return message;
+            } );
+        co_await waitCommitted( ticket );
+        co_return stored;
     }
 
     awaitable<void> addRoom( const std::string& room )
     {
-        co_await asio::post( asio::bind_executor( strand_, asio::use_awaitable ) );
-        
-        auto it = chatRooms_.find( room );
-        if ( it == chatRooms_.end() )
-            chatRooms_.emplace( room, ChatRoom{ .name = room } );
+        uint64_t ticket = 0;
+        auto& shard = directory_.get( room );
+        co_await runOn( shard.strand,
+            [&]()
+            {
+                auto current = shard.state.rooms.load( std::memory_order_acquire );
+                if ( current->contains( room ) )
+                    return;
+
+                // Logged before it is published, so no message of the room can precede it in the log
+                if ( log_ )
+                    ticket = log_->appendRoom( room );
+                auto rooms = std::make_shared<RoomMap>( *current );
+                rooms->emplace( room, makeRoom( room ) );
+                shard.state.rooms.store( std::move( rooms ), std::memory_order_release );
+            } );
+        co_await waitCommitted( ticket );
     }
 
-    awaitable<std::vector<ChatMessage>> getRoomMessages( const std::string& room ) const
+    // Up to limit messages with seq below before
+    awaitable<HistoryPageView> getRoomPage( const std::string& room, uint64_t before, size_t limit ) const
     {
-        co_await asio::post( asio::bind_executor( strand_, asio::use_awaitable ) );
+        auto shard = findRoom( room );
+        if ( not shard )
+            co_return HistoryPageView{ .room = room };
+        co_return co_await makePage( room, *shard, 0, before, limit );
+    }
 
-        auto it = chatRooms_.find( room );
-        if ( it == chatRooms_.end() )
-            co_return std::vector<ChatMessage>();
-        co_return it->second.messages;
+    // Messages from seq since on, only the latest limit of them when more are missing
+    awaitable<HistoryPageView> getRoomDelta( const std::string& room, uint64_t since, size_t limit ) const
+    {
+        auto shard = findRoom( room );
+        if ( not shard )
+            co_return HistoryPageView{ .room = room };
+        co_return co_await makePage( room, *shard, since, std::numeric_limits<uint64_t>::max(), limit );
     }
 
-    awaitable<std::vector<std::string>> getRoomNames() const
+    // Rooms are never removed, so a room found once stays
+    bool hasRoom( const std::string& room ) const
     {
-        co_await asio::post( asio::bind_executor( strand_, asio::use_awaitable ) );
+        return findRoom( room ) != nullptr;
+    }
 
+    std::vector<std::string> getRoomNames() const
+    {
         std::vector<std::string> names;
-        for ( const auto& [name, _] : chatRooms_ )
+        for ( const auto& [name, _] : getRooms() )
             names.push_back( name );
-        co_return names;
+        return names;
+    }
+
+private:
+    std::shared_ptr<Room> makeRoom( const std::string& name ) const
+    {
+        if ( not cold_ )
+            return std::make_shared<Room>( asio::make_strand( ioContext_ ), MessageStore( retention_ ) );
+
+        auto cold = cold_->getRoom( name );
+        auto evict = [store = cold_.get(), cold]( MessageStore::Range range ) { store->evict( cold, std::move( range ) ); };
+        return std::make_shared<Room>( asio::make_strand( ioContext_ ), MessageStore( retention_, std::move( evict ) ), cold );
+    }
+
+    awaitable<void> waitCommitted( uint64_t ticket ) const
+    {
+        if ( ticket and not asyncCommit_ )
+            co_await log_->waitCommitted( ticket );
+    }
+
+    // Checkpoints only when something was appended since the last one
+    awaitable<void> checkpointLoop( std::chrono::seconds interval )
+    {
+        asio::steady_timer timer( ioContext_ );
+        uint64_t checkpointed = 0;
+        for ( ;; )
+        {
+            timer.expires_after( interval );
+            co_await timer.async_wait( asio::use_awaitable );
+
+            const uint64_t appended = log_->getAppended();
+            if ( appended == checkpointed )
+                continue;
+            try
+            {
+                co_await checkpoint();
+                checkpointed = appended;
+            }
+            catch ( const std::exception& e )
+            {
+                std::cerr << "Error: Checkpoint failed: " << e.what() << "\n";
+            }
+        }
+    }
+
+    // Rebuilds every room from the newest checkpoint and the log after it,
+    // before any other thread can see the database
+    void recover()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::optional<uint64_t> instanceId;
+        RoomMap rooms;
+        std::string lastName;
+        Room* last = nullptr;  // Consecutive messages mostly go to the same room
+
+        log_->recover(
+            [&]( const LogRecord& record )
+            {
+                switch ( record.type )
+                {
+                    case LogRecord::Type::Instance:
+                        if ( not instanceId )
+                            instanceId = record.instanceId;
+                        break;
+                    case LogRecord::Type::Room:
+                    {
+                        auto it = rooms.try_emplace( std::string( record.room ), makeRoom( std::string( record.room ) ) ).first;
+                        it->second->messages.startAt( record.seq );
+                        break;
+                    }
+                    case LogRecord::Type::Message:
+                    {
+                        if ( not last or lastName != record.room )
+                        {
+                            lastName = record.room;
+                            auto it = rooms.find( lastName );
+                            if ( it == rooms.end() )
+                                throw std::runtime_error( "Log message for unknown room " + lastName );
+                            last = it->second.get();
+                        }
+                        // The log after a checkpoint repeats what the checkpoint already holds
+                        auto& messages = last->messages;
+                        if ( record.seq < messages.nextSeq() )
+                            break;
+                        if ( messages.size() == 0 )
+                            messages.startAt( record.seq );
+                        if ( record.seq != messages.nextSeq() )
+                            throw std::runtime_error( "Log message out of sequence in room " + lastName );
+                        messages.replay( record.sender, record.content, record.timestamp );
+                        ++( record.fromCheckpoint ? stats_.checkpointMessages : stats_.replayedMessages );
+                        break;
+                    }
+                }
+            } );
+
+        if ( instanceId )
+            instanceId_ = *instanceId;
+        const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>( std::chrono::steady_clock::now() - start );
+        stats_.recoveryMillis = elapsed.count();
+        std::cout << "Info: Recovered " << rooms.size() << " rooms and "
+                  << stats_.checkpointMessages + stats_.replayedMessages << " messages from "
+                  << log_->getDirectory() << " in " << elapsed.count() << " ms\n";
+
+        std::unordered_map<Directory*, RoomMap> shards;
+        for ( auto& [name, room] : rooms )
+            shards[&directory_.get( name ).state].emplace( name, std::move( room ) );
+        for ( auto& [directory, shardRooms] : shards )
+            directory->rooms.store( std::make_shared<const RoomMap>( std::move( shardRooms ) ), std::memory_order_release );
+    }
+
+    std::shared_ptr<Room> findRoom( const std::string& room ) const
+    {
+        const auto rooms = directory_.get( room ).state.rooms.load( std::memory_order_acquire );
+        auto it = rooms->find( room );
+        if ( it != rooms->end() )
+            return it->second;
+        return nullptr;
+    }
+
+    // Every room of every shard, each shard as of when it is visited
+    std::vector<std::pair<std::string, std::shared_ptr<Room>>> getRooms() const
+    {
+        std::vector<std::pair<std::string, std::shared_ptr<Room>>> rooms;
+        directory_.forEach(
+            [&]( const auto& shard )
+            {
+                const auto shardRooms = shard.state.rooms.load( std::memory_order_acquire );
+                rooms.insert( rooms.end(), shardRooms->begin(), shardRooms->end() );
+            } );
+        return rooms;
     }
 
-    awaitable<std::vector<ChatRoom>> getRooms() const
+    // The latest limit retained messages with seq in [since, before). The hot part is pinned on
+    // the room's strand in O(1), only what lies below it is read back from the cold tier.
+    awaitable<HistoryPageView> makePage( const std::string& name, const Room& room,
+                                         uint64_t since, uint64_t before, size_t limit ) const
     {
-        co_await asio::post( asio::bind_executor( strand_, asio::use_awaitable ) );
+        uint64_t first = 0;
+        uint64_t begin = 0;
+        auto messages = co_await runOn( room.strand,
+            [&]()
+            {
+                const auto snapshot = room.messages.snapshot();
+                first = snapshot.firstSeq();
+                if ( room.cold )
+                    first = std::min( first, room.cold->firstSeq().value_or( first ) );
+                const uint64_t end = std::clamp( before, first, snapshot.nextSeq() );
+                begin = std::clamp( since, end - std::min<uint64_t>( end - first, limit ), end );
+                return snapshot.range( begin, end );
+            } );
 
-        std::vector<ChatRoom> rooms;
-        for ( const auto& [_, room] : chatRooms_ )
-            rooms.push_back( room );
-        co_return rooms;
+        if ( begin < messages.from() )
+            messages.prepend( co_await cold_->read( room.cold, begin, messages.from() ) );
+        else if ( cold_ )
+            cold_->getStats().hotReads++;
+        co_return HistoryPageView{ .room = name, .messages = std::move( messages ), .cursor = begin, .hasMore = begin > first };
     }
-};
\ No newline at end of file
+};
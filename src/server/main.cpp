@@ -6,13 +6,140 @@
 
 int main( int argc, char* argv[] )
 {
-    Server server( "127.0.0.1", 8080 );
+    std::string address;
+    int port = 0;
+    int threads = 0;
+    int listeners = 0;
+    size_t roomShards = 0;
+    std::string overflowPolicy;
+    SessionOptions sessionOptions;
+    CompressionOptions compressionOptions;
+    HistoryOptions historyOptions;
+    BatchOptions batchOptions;
+    RetentionOptions retentionOptions;
+    RetentionOptions hotOptions;
+    LogOptions logOptions;
 
-    Database database( server.getIOContext() );
-    server.addController( ClientMessageType::InitSession, OnInitSessionController( server, database ) );
+    po::options_description description( "Chat server options" );
+    description.add_options()
+        ( "help,h", "Show this help" )
+        ( "address", po::value( &address )->default_value( "127.0.0.1" ), "Listen address" )
+        ( "port", po::value( &port )->default_value( 8080 ), "Listen port" )
+        ( "threads", po::value( &threads )->default_value( static_cast<int>( std::max( 1u, std::thread::hardware_concurrency() ) ) ),
+          "Worker threads running the io_context" )
+        ( "listeners", po::value( &listeners )->default_value( 1 ),
+          "Acceptors bound to the port with SO_REUSEPORT" )
+        ( "room-shards", po::value( &roomShards )->default_value( roomShards ),
+          "Shards of the room directory and subscriptions, each with its own strand, 0 uses one per thread" )
+        ( "max-queued-messages", po::value( &sessionOptions.maxQueuedMessages )->default_value( sessionOptions.maxQueuedMessages ),
+          "Outbound queue length per session before the overflow policy applies" )
+        ( "max-queued-bytes", po::value( &sessionOptions.maxQueuedBytes )->default_value( sessionOptions.maxQueuedBytes ),
+          "Outbound queue size per session before the overflow policy applies" )
+        ( "max-coalesced-bytes", po::value( &sessionOptions.maxCoalescedBytes )->default_value( sessionOptions.maxCoalescedBytes ),
+          "Queued frames a session sends with one socket write, 0 writes every frame on its own" )
+        ( "max-inbound-messages", po::value( &sessionOptions.maxInboundMessages )->default_value( sessionOptions.maxInboundMessages ),
+          "Requests a session reads ahead before it waits for them to be processed" )
+        ( "inbound-workers", po::value( &sessionOptions.inboundWorkers )->default_value( sessionOptions.inboundWorkers ),
+          "Requests of one session processed concurrently, requests for the same room stay in order" )
+        ( "overflow-policy", po::value( &overflowPolicy )->default_value( "DropOldest" ),
+          "DropOldest, DropNew, Coalesce or Disconnect" )
+        ( "deflate", po::value( &compressionOptions.enabled )->default_value( compressionOptions.enabled ),
+          "Offer permessage-deflate to clients" )
+        ( "deflate-window-bits", po::value( &compressionOptions.windowBits )->default_value( compressionOptions.windowBits ),
+          "LZ77 window size, 9..15" )
+        ( "deflate-mem-level", po::value( &compressionOptions.memLevel )->default_value( compressionOptions.memLevel ),
+          "Deflate memory level, 1..9" )
+        ( "deflate-level", po::value( &compressionOptions.compressionLevel )->default_value( compressionOptions.compressionLevel ),
+          "Compression level, 0..9" )
+        ( "deflate-min-size", po::value( &compressionOptions.minSize )->default_value( compressionOptions.minSize ),
+          "Messages below this size are sent uncompressed" )
+        ( "deflate-no-context-takeover", po::bool_switch( &compressionOptions.noContextTakeover ),
+          "Reset the compression context after every message" )
+        ( "history-initial", po::value( &historyOptions.initialMessages )->default_value( historyOptions.initialMessages ),
+          "Messages per room sent on InitSession and JoinRoom" )
+        ( "history-page-max", po::value( &historyOptions.maxPageSize )->default_value( historyOptions.maxPageSize ),
+          "Largest FetchHistory page the server returns" )
+        ( "history-stream-chunk", po::value( &historyOptions.streamChunk )->default_value( historyOptions.streamChunk ),
+          "Messages per frame when streaming history on InitSession" )
+        ( "batch-window-us", po::value( &batchOptions.windowMicros )->default_value( batchOptions.windowMicros ),
+          "Window in which a room's new messages are sent as one frame, 0 sends every message at once" )
+        ( "batch-max-messages", po::value( &batchOptions.maxMessages )->default_value( batchOptions.maxMessages ),
+          "Messages after which a batch is sent before its window ends" )
+        ( "retention-messages", po::value( &retentionOptions.maxMessages )->default_value( retentionOptions.maxMessages ),
+          "Messages kept per room, 0 keeps all" )
+        ( "retention-bytes", po::value( &retentionOptions.maxBytes )->default_value( retentionOptions.maxBytes ),
+          "Message bytes kept per room, 0 keeps all" )
+        ( "log-dir", po::value( &logOptions.directory ),
+          "Directory of the message log, rooms and messages are kept in memory only without it" )
+        ( "log-segment-bytes", po::value( &logOptions.segmentBytes )->default_value( logOptions.segmentBytes ),
+          "Size at which the log starts a new segment file" )
+        ( "log-commit-delay-us", po::value( &logOptions.commitDelayMicros )->default_value( logOptions.commitDelayMicros ),
+          "How long a log commit waits for more messages to share its fdatasync" )
+        ( "log-async-commit", po::bool_switch( &logOptions.asyncCommit ),
+          "Broadcast messages before they are on disk, a crash may lose the last commit" )
+        ( "log-checkpoint-seconds", po::value( &logOptions.checkpointSeconds )->default_value( logOptions.checkpointSeconds ),
+          "Interval of checkpoints that bound the log replayed on startup, 0 disables them" )
+        ( "hot-messages", po::value( &hotOptions.maxMessages )->default_value( hotOptions.maxMessages ),
+          "Messages per room kept in memory, older ones move to compressed files in the log dir" )
+        ( "hot-bytes", po::value( &hotOptions.maxBytes )->default_value( hotOptions.maxBytes ),
+          "Message bytes per room kept in memory, older ones move to compressed files in the log dir" );
+
+    try
+    {
+        po::variables_map variables;
+        po::store( po::parse_command_line( argc, argv, description ), variables );
+        po::notify( variables );
+
+        if ( variables.count( "help" ) )
+        {
+            std::cout << description << "\n";
+            return 0;
+        }
+
+        auto policy = magic_enum::enum_cast<OverflowPolicy>( overflowPolicy );
+        if ( not policy )
+            throw po::error( "unknown overflow policy: " + overflowPolicy );
+        sessionOptions.overflowPolicy = policy.value();
+
+        // Beast only checks these in set_option, which would then fail for every connection
+        if ( compressionOptions.windowBits < 9 or compressionOptions.windowBits > 15 )
+            throw po::error( "--deflate-window-bits must be in 9..15" );
+        if ( compressionOptions.memLevel < 1 or compressionOptions.memLevel > 9 )
+            throw po::error( "--deflate-mem-level must be in 1..9" );
+        if ( compressionOptions.compressionLevel < 0 or compressionOptions.compressionLevel > 9 )
+            throw po::error( "--deflate-level must be in 0..9" );
+
+        if ( ( hotOptions.maxMessages or hotOptions.maxBytes ) and logOptions.directory.empty() )
+            throw po::error( "a hot window needs --log-dir" );
+        // The cold tier keeps every evicted message, retention would only bound the hot window
+        if ( ( hotOptions.maxMessages or hotOptions.maxBytes ) and ( retentionOptions.maxMessages or retentionOptions.maxBytes ) )
+            throw po::error( "--retention-messages and --retention-bytes can't be combined with a hot window" );
+    }
+    catch ( const po::error& e )
+    {
+        std::cerr << "Error: " << e.what() << "\n" << description << "\n";
+        return 1;
+    }
+
+    if ( not roomShards )
+        roomShards = static_cast<size_t>( std::max( threads, 1 ) );
+    Server server( address, port, threads, listeners, roomShards );
+    server.setSessionOptions( sessionOptions );
+    server.setCompressionOptions( compressionOptions );
+
+    Database database( server.getIOContext(), retentionOptions, logOptions, hotOptions, roomShards );
+    server.addController( ClientMessageType::InitSession, OnInitSessionController( server, database, historyOptions ) );
     server.addController( ClientMessageType::PostNewRoom, OnNewRoomController( server, database ) );
-    server.addController( ClientMessageType::PostMessage, OnNewMessageController( server, database ) );
+    MessageBatcher batcher( server, batchOptions, roomShards );
+    server.addController( ClientMessageType::PostMessage, OnNewMessageController( batcher, database ) );
+    server.addController( ClientMessageType::JoinRoom, OnJoinRoomController( server, database, historyOptions ) );
+    server.addController( ClientMessageType::LeaveRoom, OnLeaveRoomController( server ) );
+    server.addController( ClientMessageType::FetchHistory, OnFetchHistoryController( server, database, historyOptions ) );
 
     server.run();
+    if ( not logOptions.directory.empty() )
+        database.getPersistenceStats().print( std::cout );
+    if ( const auto* stats = database.getTierStats() )
+        stats->print( std::cout );
     return 0;
 }
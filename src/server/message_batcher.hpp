@@ -0,0 +1,90 @@
+#pragma once
+#include "common/response_datamodel.hpp"
+#include "room_shards.hpp"
+#include "server.hpp"
+
+struct BatchOptions
+{
+    size_t windowMicros = 0;  // How long a room's new messages are collected into one frame, 0 sends each at once
+    size_t maxMessages = 64;  // A batch is sent early once it holds this many
+};
+
+// Broadcasts new messages to a room's subscribers, optionally batched. Messages of a room
+// posted within the window share one NewMessages frame, so every subscriber gets one frame
+// and one write for the whole burst instead of one per message.
+class MessageBatcher
+{
+    struct Batch
+    {
+        std::vector<ChatMessage> messages;
+        uint64_t id = 0;  // Tells the window's timer whether its batch was already sent
+    };
+
+    struct Batches
+    {
+        std::unordered_map<std::string, Batch> rooms;
+        uint64_t nextId = 0;
+    };
+
+    using Shard = RoomShards<Batches>::Shard;
+
+    Server& server_;
+    BatchOptions options_;
+    RoomShards<Batches> shards_;
+
+public:
+    MessageBatcher( Server& server, const BatchOptions& options = {}, size_t shards = 1 )
+        : server_( server ),
+          options_( options ),
+          shards_( server.getIOContext(), shards )
+    {}
+
+    void broadcast( const std::string& room, ChatMessage message )
+    {
+        if ( not options_.windowMicros )
+        {
+            server_.broadcastToRoom( room, makeSharedMessage( ServerMessageType::NewMessage,
+                                                              NewMessage{ .room = room, .chatMessage = std::move( message ) } ) );
+            return;
+        }
+
+        auto& shard = shards_.get( room );
+        asio::post( shard.strand,
+            [this, &shard, room, message = std::move( message )]() mutable
+            {
+                auto& batch = shard.state.rooms[room];
+                batch.messages.push_back( std::move( message ) );
+                if ( batch.messages.size() >= options_.maxMessages )
+                    flush( shard, room );
+                else if ( batch.messages.size() == 1 )
+                    asio::co_spawn( shard.strand, flushAfterWindow( shard, room, batch.id = ++shard.state.nextId ), asio::detached );
+            } );
+    }
+
+private:
+    awaitable<void> flushAfterWindow( Shard& shard, std::string room, uint64_t id )
+    {
+        asio::steady_timer timer( shard.strand, std::chrono::microseconds( options_.windowMicros ) );
+        co_await timer.async_wait( asio::use_awaitable );
+
+        auto it = shard.state.rooms.find( room );
+        if ( it != shard.state.rooms.end() and it->second.id == id )
+            flush( shard, room );
+    }
+
+    // Runs on the shard's strand
+    void flush( Shard& shard, const std::string& room )
+    {
+        auto node = shard.state.rooms.extract( room );
+        auto& messages = node.mapped().messages;
+
+        // Posters finish their appends in parallel, so they may arrive out of seq order
+        std::ranges::sort( messages, {}, &ChatMessage::seq );
+        if ( messages.size() == 1 )
+            server_.broadcastToRoom( room, makeSharedMessage( ServerMessageType::NewMessage,
+                                                              NewMessage{ .room = room, .chatMessage = std::move( messages.front() ) } ) );
+        else
+            server_.broadcastToRoom( room, makeSharedMessage( ServerMessageType::NewMessages,
+                                                              NewMessages{ .room = room, .chatMessages = std::move( messages ) } ) );
+    }
+};
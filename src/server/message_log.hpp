@@ -0,0 +1,674 @@
+#pragma once
+#include "common/datamodel.hpp"
+#include "common/helpers.hpp"
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+struct LogOptions
+{
+    std::string directory;                     // Empty keeps everything in memory only
+    size_t segmentBytes = 64 * 1024 * 1024;    // A new segment file is started past this size
+    size_t commitDelayMicros = 1000;           // How long a commit waits for more records to share its fdatasync
+    bool asyncCommit = false;                  // Acknowledge before the commit, a crash may lose the last commit window
+    size_t checkpointSeconds = 300;            // Interval of background checkpoints, 0 disables them
+};
+
+// Checkpoint and recovery figures, printed on shutdown
+struct PersistenceStats
+{
+    std::atomic<uint64_t> checkpoints{ 0 };
+    std::atomic<uint64_t> lastCheckpointMillis{ 0 };
+    std::atomic<uint64_t> lastCheckpointMessages{ 0 };
+    std::atomic<uint64_t> lastCheckpointBytes{ 0 };
+    uint64_t recoveryMillis = 0;
+    uint64_t checkpointMessages = 0;  // Loaded from the checkpoint on startup
+    uint64_t replayedMessages = 0;    // Replayed from the log after it
+
+    void print( std::ostream& out ) const
+    {
+        out << "Info: Persistence stats: recovered " << checkpointMessages << " messages from the checkpoint and "
+            << replayedMessages << " from the log in " << recoveryMillis << " ms, "
+            << checkpoints << " checkpoints, the last with " << lastCheckpointMessages << " messages, "
+            << lastCheckpointBytes << " bytes in " << lastCheckpointMillis << " ms\n";
+    }
+};
+
+// One record as read back from the log, views point into the mapped segment
+struct LogRecord
+{
+    enum class Type : uint8_t
+    {
+        Instance = 1,  // First record of every segment
+        Room,
+        Message
+    };
+
+    Type type;
+    bool fromCheckpoint = false;
+    uint64_t instanceId = 0;
+    uint64_t seq = 0;  // For a room, the seq its history starts at
+    int64_t timestamp = 0;
+    std::string_view room{};
+    std::string_view sender{};
+    std::string_view content{};
+};
+
+// Append-only log of rooms and messages, split into numbered segment files.
+// Every record is framed as [payload size][crc32 of payload][payload], in little-endian host byte order.
+// Appends only copy the record into a buffer; a single writer thread flushes the buffer
+// with one write and one fdatasync per batch (group commit), so the cost of a sync is
+// shared by every record that arrived while the previous one was running.
+// A checkpoint N holds everything segments before N led to, so those can be deleted and
+// recovery reads the newest checkpoint plus the segments from N on.
+class MessageLog
+{
+    struct Header
+    {
+        uint32_t size;
+        uint32_t crc;
+    };
+
+    static constexpr std::string_view SegmentExtension = ".log";
+    static constexpr std::string_view CheckpointExtension = ".checkpoint";
+    static constexpr std::string_view TemporaryExtension = ".tmp";
+
+    LogOptions options_;
+    asio::thread_pool writer_{ 1 };        // Blocking file I/O stays off the io_context threads
+    asio::thread_pool checkpointer_{ 1 };  // Checkpoints never hold up commits
+
+    std::mutex mutex_;
+    std::string pending_;           // Records not yet handed to the writer
+    uint64_t appended_ = 0;         // Tickets handed out so far
+    bool commitScheduled_ = false;
+    std::string failure_;           // Set by the writer once a write or sync failed, appends are refused from then on
+
+    // Writer thread only
+    std::string writing_;
+    uint64_t committed_ = 0;        // Every ticket up to this one is on disk
+    asio::steady_timer commitTimer_;
+    asio::steady_timer commitSignal_;  // Never expires, cancelled to wake waitCommitted
+    uint64_t instanceId_ = 0;  // Set by open before anything is written
+    uint64_t nextSegment_ = 0;
+    size_t segmentSize_ = 0;
+    int fd_ = -1;
+
+public:
+    // State of all rooms, written as a temporary file that is renamed once complete
+    class Checkpoint
+    {
+        std::filesystem::path path_;
+        std::filesystem::path temporary_;
+        int fd_ = -1;
+        std::string buffer_;
+        size_t rooms_ = 0;
+        size_t messages_ = 0;
+        size_t bytes_ = 0;
+
+        static constexpr size_t FlushBytes = 1024 * 1024;
+
+    public:
+        struct Totals
+        {
+            size_t rooms = 0;
+            size_t messages = 0;
+            size_t bytes = 0;
+        };
+
+        Checkpoint( std::filesystem::path path, uint64_t instanceId )
+            : path_( std::move( path ) ),
+              temporary_( path_.string() + std::string( TemporaryExtension ) )
+        {
+            fd_ = ::open( temporary_.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644 );
+            if ( fd_ < 0 )
+                throwError( "open " + temporary_.string() );
+            encodeInstance( buffer_, instanceId );
+        }
+
+        ~Checkpoint()
+        {
+            if ( fd_ < 0 )
+                return;
+            ::close( fd_ );
+            ::unlink( temporary_.c_str() );
+        }
+
+        Checkpoint( const Checkpoint& ) = delete;
+        Checkpoint& operator=( const Checkpoint& ) = delete;
+
+        void addRoom( std::string_view room, uint64_t firstSeq )
+        {
+            encodeRoom( buffer_, room, firstSeq );
+            ++rooms_;
+            flushIfFull();
+        }
+
+        void addMessage( std::string_view room, uint64_t seq, int64_t timestamp, std::string_view sender, std::string_view content )
+        {
+            encodeMessage( buffer_, room, seq, timestamp, sender, content );
+            ++messages_;
+            flushIfFull();
+        }
+
+        // Makes the checkpoint durable under its final name
+        Totals finish()
+        {
+            flush();
+            if ( ::fdatasync( fd_ ) != 0 )
+                throwError( "fdatasync " + temporary_.string() );
+            ::close( fd_ );
+            fd_ = -1;
+            std::filesystem::rename( temporary_, path_ );
+            syncDirectory( path_.parent_path() );
+            return Totals{ .rooms = rooms_, .messages = messages_, .bytes = bytes_ };
+        }
+
+    private:
+        void flushIfFull()
+        {
+            if ( buffer_.size() >= FlushBytes )
+                flush();
+        }
+
+        void flush()
+        {
+            if ( not writeAll( fd_, buffer_ ) )
+                throwError( "write " + temporary_.string() );
+            bytes_ += buffer_.size();
+            buffer_.clear();
+        }
+    };
+
+    explicit MessageLog( const LogOptions& options )
+        : options_( options ),
+          commitTimer_( writer_.get_executor() ),
+          commitSignal_( writer_.get_executor(), asio::steady_timer::time_point::max() )
+    {}
+
+    // Commits whatever is still buffered before closing
+    ~MessageLog()
+    {
+        checkpointer_.join();
+        asio::post( writer_,
+            [this]()
+            {
+                commitTimer_.cancel();
+                commit();
+                commitSignal_.cancel();
+            } );
+        writer_.join();
+        if ( fd_ >= 0 )
+            ::close( fd_ );
+    }
+
+    MessageLog( const MessageLog& ) = delete;
+    MessageLog& operator=( const MessageLog& ) = delete;
+
+    const std::string& getDirectory() const
+    {
+        return options_.directory;
+    }
+
+    // Calls onRecord for the newest checkpoint and then every later record in log order.
+    // Files are memory-mapped and read in place. A torn record at the end of the newest
+    // segment is cut off, damage anywhere else throws.
+    template <typename Function>
+    void recover( Function onRecord )
+    {
+        std::filesystem::create_directories( options_.directory );
+        removeTemporaries();
+
+        const auto checkpoints = listFiles( CheckpointExtension );
+        uint64_t first = 0;
+        if ( not checkpoints.empty() )
+        {
+            const auto& [number, path] = checkpoints.back();
+            auto fromCheckpoint = [&]( LogRecord& record )
+            {
+                record.fromCheckpoint = true;
+                onRecord( record );
+            };
+            const auto [valid, size] = replayFile( path, fromCheckpoint );
+            if ( valid != size )
+                throw std::runtime_error( "Corrupt checkpoint " + path.string() + " at offset " + std::to_string( valid ) );
+            first = number;
+        }
+        removeBefore( first );
+
+        const auto segments = listFiles( SegmentExtension );
+        for ( size_t i = 0; i < segments.size(); ++i )
+        {
+            const auto& path = segments[i].second;
+            const auto [valid, size] = replayFile( path, onRecord );
+            if ( valid == size )
+                continue;
+            if ( i + 1 < segments.size() )
+                throw std::runtime_error( "Corrupt log record in " + path.string() + " at offset " + std::to_string( valid ) );
+
+            std::cerr << "Error: Dropping " << size - valid << " torn bytes at the end of " << path.string() << "\n";
+            std::filesystem::resize_file( path, valid );
+        }
+        nextSegment_ = segments.empty() ? first : segments.back().first + 1;
+    }
+
+    // Appends go to a fresh segment, opened with the first commit. Every segment begins with the instance id.
+    void open( uint64_t instanceId )
+    {
+        instanceId_ = instanceId;
+    }
+
+    // Both return a ticket for waitCommitted
+    uint64_t appendRoom( std::string_view room )
+    {
+        std::lock_guard lock( mutex_ );
+        checkWritable();
+        encodeRoom( pending_, room, 0 );
+        return scheduleAppended();
+    }
+
+    uint64_t appendMessage( std::string_view room, const ChatMessage& message )
+    {
+        std::lock_guard lock( mutex_ );
+        checkWritable();
+        encodeMessage( pending_, room, message.seq, message.timestamp, message.sender, message.content );
+        return scheduleAppended();
+    }
+
+    uint64_t getAppended()
+    {
+        std::lock_guard lock( mutex_ );
+        return appended_;
+    }
+
+    // Commits what is buffered and moves appends on to a new segment, whose number is returned.
+    // Whatever was appended before the call is then in the segments below that number.
+    awaitable<uint64_t> rotate()
+    {
+        co_return co_await runOn( writer_.get_executor(),
+            [this]()
+            {
+                commit();
+                // Nothing may be checkpointed that the log failed to hold
+                if ( not failure_.empty() )
+                    throw std::runtime_error( failure_ );
+                if ( fd_ >= 0 )
+                {
+                    ::close( fd_ );
+                    fd_ = -1;
+                }
+                return nextSegment_;
+            } );
+    }
+
+    // Writes the checkpoint for segment on the checkpoint thread, fill adds the rooms and messages to it.
+    // Once the checkpoint is durable, the segments and checkpoints it replaces are deleted.
+    template <typename Function>
+    awaitable<Checkpoint::Totals> writeCheckpoint( uint64_t segment, Function fill )
+    {
+        co_return co_await runOn( checkpointer_.get_executor(),
+            [&]()
+            {
+                Checkpoint checkpoint( filePath( segment, CheckpointExtension ), instanceId_ );
+                fill( checkpoint );
+                const auto totals = checkpoint.finish();
+                removeBefore( segment );
+                return totals;
+            } );
+    }
+
+    // Resumes once the record behind ticket is on disk, throws if the log failed before it got there
+    awaitable<void> waitCommitted( uint64_t ticket )
+    {
+        co_await asio::co_spawn(
+            writer_.get_executor(),
+            [this, ticket]() -> awaitable<void>
+            {
+                // failure_ is only written on the writer thread, this runs there too
+                while ( committed_ < ticket and failure_.empty() )
+                {
+                    boost::system::error_code ec;
+                    co_await commitSignal_.async_wait( asio::redirect_error( asio::use_awaitable, ec ) );
+                }
+                if ( committed_ < ticket )
+                    throw std::runtime_error( failure_ );
+            },
+            asio::use_awaitable );
+    }
+
+private:
+    template <typename T>
+    static void appendValue( std::string& out, T value )
+    {
+        out.append( reinterpret_cast<const char*>( &value ), sizeof( value ) );
+    }
+
+    template <typename T>
+    static T readValue( const char* data )
+    {
+        T value;
+        std::memcpy( &value, data, sizeof( value ) );
+        return value;
+    }
+
+    // The header is filled in by endRecord once the payload size is known
+    static size_t beginRecord( std::string& out, LogRecord::Type type )
+    {
+        const size_t start = out.size();
+        out.append( sizeof( Header ), '\0' );
+        out += static_cast<char>( type );
+        return start;
+    }
+
+    static void endRecord( std::string& out, size_t start )
+    {
+        const char* payload = out.data() + start + sizeof( Header );
+        const size_t size = out.size() - start - sizeof( Header );
+        const Header header{ .size = static_cast<uint32_t>( size ), .crc = static_cast<uint32_t>( crc32_z( 0, reinterpret_cast<const Bytef*>( payload ), size ) ) };
+        std::memcpy( out.data() + start, &header, sizeof( header ) );
+    }
+
+    static void encodeInstance( std::string& out, uint64_t instanceId )
+    {
+        const size_t start = beginRecord( out, LogRecord::Type::Instance );
+        appendValue( out, instanceId );
+        endRecord( out, start );
+    }
+
+    static void encodeRoom( std::string& out, std::string_view room, uint64_t firstSeq )
+    {
+        const size_t start = beginRecord( out, LogRecord::Type::Room );
+        appendValue( out, firstSeq );
+        out += room;
+        endRecord( out, start );
+    }
+
+    static void encodeMessage( std::string& out, std::string_view room, uint64_t seq, int64_t timestamp,
+                               std::string_view sender, std::string_view content )
+    {
+        const size_t start = beginRecord( out, LogRecord::Type::Message );
+        appendValue( out, seq );
+        appendValue( out, timestamp );
+        appendValue( out, static_cast<uint32_t>( room.size() ) );
+        appendValue( out, static_cast<uint32_t>( sender.size() ) );
+        out += room;
+        out += sender;
+        out += content;
+        endRecord( out, start );
+    }
+
+    // Called with mutex_ held before a record goes into pending_
+    void checkWritable() const
+    {
+        if ( not failure_.empty() )
+            throw std::runtime_error( failure_ );
+    }
+
+    // Called with mutex_ held after a record went into pending_
+    uint64_t scheduleAppended()
+    {
+        if ( not commitScheduled_ )
+        {
+            commitScheduled_ = true;
+            asio::post( writer_, [this]() { scheduleCommit(); } );
+        }
+        return ++appended_;
+    }
+
+    // Writer thread: lets more records gather before the batch is synced
+    void scheduleCommit()
+    {
+        if ( options_.commitDelayMicros == 0 )
+        {
+            commit();
+            return;
+        }
+        commitTimer_.expires_after( std::chrono::microseconds( options_.commitDelayMicros ) );
+        commitTimer_.async_wait( [this]( const boost::system::error_code& ) { commit(); } );
+    }
+
+    // Writer thread: one write and one fdatasync for everything appended so far
+    void commit()
+    {
+        uint64_t ticket = 0;
+        {
+            std::lock_guard lock( mutex_ );
+            writing_.swap( pending_ );
+            ticket = appended_;
+            commitScheduled_ = false;
+        }
+
+        if ( not writing_.empty() and failure_.empty() )
+        {
+            try
+            {
+                if ( fd_ < 0 or segmentSize_ >= options_.segmentBytes )
+                    openSegment();
+                write( writing_ );
+                // A sync that failed can't be retried safely, acknowledging later would lie
+                if ( ::fdatasync( fd_ ) != 0 )
+                    throwError( "fdatasync" );
+            }
+            catch ( const std::exception& e )
+            {
+                fail( e.what() );
+            }
+        }
+        writing_.clear();
+
+        if ( failure_.empty() )
+            committed_ = ticket;
+        commitSignal_.cancel();
+    }
+
+    // Writer thread: nothing is committed from now on, waiters and later appends get the error.
+    // What was appended stays in memory but is never acknowledged.
+    void fail( const std::string& error )
+    {
+        std::cerr << "Error: Message log " << error << ", no more messages are accepted\n";
+        std::lock_guard lock( mutex_ );
+        failure_ = "Message log " + error;
+        pending_.clear();
+        if ( fd_ >= 0 )
+        {
+            ::close( fd_ );
+            fd_ = -1;
+        }
+    }
+
+    void openSegment()
+    {
+        if ( fd_ >= 0 )
+            ::close( fd_ );
+
+        const auto path = filePath( nextSegment_++, SegmentExtension );
+        fd_ = ::open( path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644 );
+        if ( fd_ < 0 )
+            throwError( "open " + path.string() );
+        segmentSize_ = 0;
+
+        std::string record;
+        encodeInstance( record, instanceId_ );
+        write( record );
+
+        // Make the new file itself durable, not only its contents
+        if ( not syncDirectory( options_.directory ) )
+            throwError( "fsync " + options_.directory );
+    }
+
+    void write( const std::string& data )
+    {
+        if ( not writeAll( fd_, data ) )
+            throwError( "write" );
+        segmentSize_ += data.size();
+    }
+
+    static bool writeAll( int fd, const std::string& data )
+    {
+        size_t written = 0;
+        while ( written < data.size() )
+        {
+            const ssize_t result = ::write( fd, data.data() + written, data.size() - written );
+            if ( result < 0 and errno == EINTR )
+                continue;
+            if ( result < 0 )
+                return false;
+            written += static_cast<size_t>( result );
+        }
+        return true;
+    }
+
+    static bool syncDirectory( const std::filesystem::path& path )
+    {
+        const int directory = ::open( path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC );
+        if ( directory < 0 )
+            return false;
+        const bool synced = ::fsync( directory ) == 0;
+        ::close( directory );
+        return synced;
+    }
+
+    // Checkpoints only fail themselves, the log is failed by commit
+    [[noreturn]] static void throwError( const std::string& operation )
+    {
+        throw std::runtime_error( operation + " failed: " + std::strerror( errno ) );
+    }
+
+    std::filesystem::path filePath( uint64_t number, std::string_view extension ) const
+    {
+        auto name = std::to_string( number );
+        name.insert( 0, 20 - name.size(), '0' );
+        return std::filesystem::path( options_.directory ) / ( name + std::string( extension ) );
+    }
+
+    // Numbered files with extension, oldest first
+    std::vector<std::pair<uint64_t, std::filesystem::path>> listFiles( std::string_view extension ) const
+    {
+        std::vector<std::pair<uint64_t, std::filesystem::path>> files;
+        for ( const auto& file : std::filesystem::directory_iterator( options_.directory ) )
+        {
+            const auto& path = file.path();
+            const auto stem = path.stem().string();
+            if ( path.extension() != extension or stem.empty() or
+                 not std::ranges::all_of( stem, []( char c ) { return c >= '0' and c <= '9'; } ) )
+                continue;
+            files.emplace_back( std::stoull( stem ), path );
+        }
+        std::ranges::sort( files );
+        return files;
+    }
+
+    // Segments and checkpoints that a checkpoint at segment made redundant
+    void removeBefore( uint64_t segment ) const
+    {
+        for ( const auto extension : { SegmentExtension, CheckpointExtension } )
+            for ( const auto& [number, path] : listFiles( extension ) )
+                if ( number < segment )
+                    std::filesystem::remove( path );
+    }
+
+    // Leftovers of checkpoints interrupted by a crash
+    void removeTemporaries() const
+    {
+        for ( const auto& file : std::filesystem::directory_iterator( options_.directory ) )
+            if ( file.path().extension() == TemporaryExtension )
+                std::filesystem::remove( file.path() );
+    }
+
+    // Returns how many bytes hold valid records, and the file size
+    template <typename Function>
+    static std::pair<size_t, size_t> replayFile( const std::filesystem::path& path, Function& onRecord )
+    {
+        const int fd = ::open( path.c_str(), O_RDONLY | O_CLOEXEC );
+        struct stat info{};
+        if ( fd < 0 or ::fstat( fd, &info ) != 0 )
+            throw std::runtime_error( "Can't open log file " + path.string() + ": " + std::strerror( errno ) );
+
+        const size_t size = static_cast<size_t>( info.st_size );
+        if ( size == 0 )
+        {
+            ::close( fd );
+            return { 0, 0 };
+        }
+
+        void* mapping = ::mmap( nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0 );
+        ::close( fd );
+        if ( mapping == MAP_FAILED )
+            throw std::runtime_error( "Can't map log file " + path.string() + ": " + std::strerror( errno ) );
+        struct Unmap
+        {
+            size_t size;
+            void operator()( void* data ) const
+            {
+                ::munmap( data, size );
+            }
+        };
+        const std::unique_ptr<void, Unmap> unmap( mapping, Unmap{ size } );
+        ::madvise( mapping, size, MADV_SEQUENTIAL );
+
+        const char* data = static_cast<const char*>( mapping );
+        size_t offset = 0;
+        while ( size - offset >= sizeof( Header ) )
+        {
+            const auto header = readValue<Header>( data + offset );
+            const char* payload = data + offset + sizeof( Header );
+            if ( header.size == 0 or header.size > size - offset - sizeof( Header ) or
+                 crc32_z( 0, reinterpret_cast<const Bytef*>( payload ), header.size ) != header.crc or not parseRecord( payload, header.size, onRecord ) )
+                break;
+            offset += sizeof( Header ) + header.size;
+        }
+        return { offset, size };
+    }
+
+    template <typename Function>
+    static bool parseRecord( const char* payload, size_t size, Function& onRecord )
+    {
+        LogRecord record{ .type = static_cast<LogRecord::Type>( payload[0] ) };
+        const char* data = payload + 1;
+        const size_t length = size - 1;
+
+        switch ( record.type )
+        {
+            case LogRecord::Type::Instance:
+            {
+                if ( length != sizeof( uint64_t ) )
+                    return false;
+                record.instanceId = readValue<uint64_t>( data );
+                break;
+            }
+            case LogRecord::Type::Room:
+            {
+                if ( length < sizeof( uint64_t ) )
+                    return false;
+                record.seq = readValue<uint64_t>( data );
+                record.room = std::string_view( data + sizeof( uint64_t ), length - sizeof( uint64_t ) );
+                break;
+            }
+            case LogRecord::Type::Message:
+            {
+                constexpr size_t Fixed = 2 * sizeof( uint64_t ) + 2 * sizeof( uint32_t );
+                if ( length < Fixed )
+                    return false;
+                record.seq = readValue<uint64_t>( data );
+                record.timestamp = readValue<int64_t>( data + 8 );
+                const auto roomSize = readValue<uint32_t>( data + 16 );
+                const auto senderSize = readValue<uint32_t>( data + 20 );
+                if ( size_t{ roomSize } + senderSize > length - Fixed )
+                    return false;
+                record.room = std::string_view( data + Fixed, roomSize );
+                record.sender = std::string_view( data + Fixed + roomSize, senderSize );
+                record.content = std::string_view( data + Fixed + roomSize + senderSize, length - Fixed - roomSize - senderSize );
+                break;
+            }
+            default:
+                return false;
+        }
+
+        onRecord( record );
+        return true;
+    }
+};
@@ -0,0 +1,458 @@
+#pragma once
+#include "common/datamodel.hpp"
+#include <deque>
+#include <functional>
+
+// Per-room history limits, 0 disables a limit.
+// Whole chunks are dropped, so a room may end up to one chunk below the limit.
+struct RetentionOptions
+{
+    size_t maxMessages = 0;
+    size_t maxBytes = 0;  // Message text plus per-message bookkeeping
+};
+
+// Compact append-only history of one room.
+// Messages are packed into chunks of fixed-size entries sharing one text arena,
+// and senders are interned per chunk, so a message costs no heap allocation of its own
+// and a sender's name goes away with the last chunk it posted in.
+// Chunks form a ref-counted chain from the newest back to the oldest. Entries are never
+// modified once written, so a Snapshot is just the newest chunk and a seq range,
+// taken in O(1) and readable from any thread while the owner keeps appending.
+class MessageStore
+{
+    struct Entry
+    {
+        int64_t timestamp;
+        const std::string* sender;  // Interned in the chunk's senders
+        uint32_t offset;            // Content position in the chunk's text
+        uint32_t size;
+    };
+
+    // Strings in a deque never move, so entries can point at them while new ones are added
+    using Senders = std::deque<std::string>;
+
+    // Appends only write past what any snapshot can see, and a chunk that has to grow
+    // is replaced by a larger copy, so shared chunks never move their data
+    struct Chunk
+    {
+        uint64_t firstSeq = 0;
+        size_t capacity = 0;
+        size_t textCapacity = 0;
+        size_t size = 0;  // Owner side only, readers go by their snapshot's range
+        size_t textSize = 0;
+        std::unique_ptr<Entry[]> entries;
+        std::unique_ptr<char[]> text;
+        std::shared_ptr<Senders> senders;  // Shared by the copies of the chunk as it grows
+        std::atomic<std::shared_ptr<const Chunk>> previous;  // Cut when the older chunk is trimmed
+
+        // Json of all entries, comma separated, built by the first reader once the chunk is sealed
+        mutable std::once_flag encodeOnce;
+        mutable std::string encoded;
+        mutable std::vector<size_t> encodedOffsets;  // Start of each entry's json, plus one past the end
+
+        size_t bytes() const
+        {
+            return textSize + size * sizeof( Entry );
+        }
+    };
+
+    static constexpr size_t MaxChunkMessages = 256;
+    static constexpr size_t MaxChunkBytes = 64 * 1024;
+    static constexpr size_t MinChunkText = 256;
+
+public:
+    class Range;
+
+    // Immutable view of the messages present when it was taken
+    class Snapshot
+    {
+        std::shared_ptr<const Chunk> head_;
+        uint64_t firstSeq_ = 0;
+        uint64_t nextSeq_ = 0;
+
+    public:
+        Snapshot() = default;
+        Snapshot( std::shared_ptr<const Chunk> head, uint64_t firstSeq, uint64_t nextSeq )
+            : head_( std::move( head ) ),
+              firstSeq_( firstSeq ),
+              nextSeq_( nextSeq )
+        {}
+
+        // Seq of the oldest retained message, equal to nextSeq() when nothing is retained
+        uint64_t firstSeq() const
+        {
+            return firstSeq_;
+        }
+
+        uint64_t nextSeq() const
+        {
+            return nextSeq_;
+        }
+
+        // Messages with seq in [from, to). Chunks trimmed after the snapshot was taken may
+        // already be gone, the range then starts after them. Taken on the owner's strand
+        // nothing is missing, and the range stays complete from then on.
+        Range range( uint64_t from, uint64_t to ) const
+        {
+            Range range;
+            range.open_ = head_.get();
+            from = std::max( from, firstSeq_ );
+            to = std::min( to, nextSeq_ );
+            if ( from >= to )
+            {
+                range.from_ = range.to_ = to;
+                return range;
+            }
+
+            // Walk back from the newest chunk, remembering where each one ends
+            uint64_t end = nextSeq_;
+            for ( auto chunk = head_; chunk and end > from; chunk = chunk->previous.load() )
+            {
+                if ( chunk->firstSeq < to )
+                    range.parts_.push_back( Range::Part{ chunk, std::max( from, chunk->firstSeq ), std::min( to, end ) } );
+                end = chunk->firstSeq;
+            }
+            std::ranges::reverse( range.parts_ );
+            range.from_ = range.parts_.empty() ? to : range.parts_.front().begin;
+            range.to_ = to;
+            return range;
+        }
+    };
+
+    // Messages [from(), to()), held by the chunks they live in, plus optionally older
+    // messages in front of them (e.g. read back from cold storage)
+    class Range
+    {
+        friend class MessageStore;
+
+        struct Part
+        {
+            std::shared_ptr<const Chunk> chunk;
+            uint64_t begin;
+            uint64_t end;
+        };
+
+        std::vector<Part> parts_;  // Oldest first
+        const Chunk* open_ = nullptr;     // Was still being filled, so its encoding is never cached
+        std::vector<ChatMessage> older_;  // Directly in front of the parts
+        uint64_t from_ = 0;
+        uint64_t to_ = 0;
+
+    public:
+        Range() = default;
+
+        uint64_t from() const
+        {
+            return from_;
+        }
+
+        uint64_t to() const
+        {
+            return to_;
+        }
+
+        size_t size() const
+        {
+            return to_ - from_;
+        }
+
+        // Puts messages in front, they have to end where the range starts
+        void prepend( std::vector<ChatMessage> older )
+        {
+            from_ -= older.size();
+            std::ranges::move( older_, std::back_inserter( older ) );
+            older_ = std::move( older );
+        }
+
+        // The part of the range with seq in [from, to)
+        Range slice( uint64_t from, uint64_t to ) const
+        {
+            Range range;
+            range.open_ = open_;
+            range.from_ = std::clamp( from, from_, to_ );
+            range.to_ = std::clamp( to, range.from_, to_ );
+            for ( const auto& message : older_ )
+                if ( message.seq >= range.from_ and message.seq < range.to_ )
+                    range.older_.push_back( message );
+            for ( const auto& part : parts_ )
+                if ( part.begin < range.to_ and part.end > range.from_ )
+                    range.parts_.push_back( Part{ part.chunk, std::max( part.begin, range.from_ ), std::min( part.end, range.to_ ) } );
+            return range;
+        }
+
+        // Calls fn( seq, timestamp, sender, content ) for every message, oldest first, without copying them
+        template <typename Function>
+        void visit( Function fn ) const
+        {
+            for ( const auto& message : older_ )
+                fn( message.seq, message.timestamp, std::string_view( message.sender ), std::string_view( message.content ) );
+            for ( const auto& part : parts_ )
+                for ( uint64_t seq = part.begin; seq < part.end; ++seq )
+                {
+                    const auto& entry = part.chunk->entries[seq - part.chunk->firstSeq];
+                    fn( seq, entry.timestamp, std::string_view( *entry.sender ),
+                        std::string_view( part.chunk->text.get() + entry.offset, entry.size ) );
+                }
+        }
+
+        std::vector<ChatMessage> read() const
+        {
+            std::vector<ChatMessage> messages = older_;
+            for ( const auto& part : parts_ )
+                for ( uint64_t seq = part.begin; seq < part.end; ++seq )
+                    messages.push_back( get( *part.chunk, seq ) );
+            return messages;
+        }
+
+        // Same messages as read, as a json array. Sealed chunks are encoded once and the
+        // result is reused by every later reader, only the open chunk is encoded per call.
+        void writeJson( std::string& out ) const
+        {
+            out += '[';
+            const size_t start = out.size();
+            for ( const auto& message : older_ )
+            {
+                if ( out.size() != start )
+                    out += ',';
+                JsonWriter( out ).write( message );
+            }
+            for ( const auto& [chunk, begin, end] : parts_ )
+            {
+                if ( out.size() != start )
+                    out += ',';
+                if ( chunk.get() != open_ )
+                {
+                    const auto& offsets = encode( *chunk );
+                    const size_t first = offsets[begin - chunk->firstSeq];
+                    out.append( chunk->encoded, first, offsets[end - chunk->firstSeq] - 1 - first );
+                    continue;
+                }
+                for ( uint64_t seq = begin; seq < end; ++seq )
+                {
+                    if ( seq != begin )
+                        out += ',';
+                    JsonWriter( out ).write( get( *chunk, seq ) );
+                }
+            }
+            out += ']';
+        }
+
+        friend void to_json( json& j, const Range& range )
+        {
+            j = range.read();
+        }
+    };
+
+    // Receives every chunk dropped by trim, as a range of its messages
+    using EvictHandler = std::function<void( Range )>;
+
+private:
+    RetentionOptions retention_;
+    size_t chunkMessages_;
+    size_t chunkBytes_;
+
+    EvictHandler evict_;
+    std::deque<std::shared_ptr<Chunk>> chunks_;  // Oldest first
+    std::unordered_map<std::string_view, const std::string*> senderIds_;  // Senders of the newest chunk
+    uint64_t nextSeq_ = 0;
+    size_t messageCount_ = 0;
+    size_t bytes_ = 0;
+
+public:
+    // Chunks shrink with tight limits so trimming a whole chunk stays a small step.
+    // With evict, trimmed chunks are handed over instead of only being dropped.
+    explicit MessageStore( const RetentionOptions& retention = {}, EvictHandler evict = {} )
+        : retention_( retention ),
+          chunkMessages_( retention.maxMessages ? std::clamp( retention.maxMessages / 4, size_t{ 1 }, MaxChunkMessages )
+                                                : MaxChunkMessages ),
+          chunkBytes_( retention.maxBytes ? std::clamp( retention.maxBytes / 4, size_t{ 1 }, MaxChunkBytes )
+                                          : MaxChunkBytes ),
+          evict_( std::move( evict ) )
+    {}
+
+    uint64_t firstSeq() const
+    {
+        return chunks_.empty() ? nextSeq_ : chunks_.front()->firstSeq;
+    }
+
+    uint64_t nextSeq() const
+    {
+        return nextSeq_;
+    }
+
+    size_t size() const
+    {
+        return messageCount_;
+    }
+
+    size_t bytes() const
+    {
+        return bytes_;
+    }
+
+    Snapshot snapshot() const
+    {
+        if ( chunks_.empty() )
+            return Snapshot( nullptr, nextSeq_, nextSeq_ );
+        return Snapshot( chunks_.back(), firstSeq(), nextSeq_ );
+    }
+
+    // Stores the message under the next seq and returns it as stored
+    ChatMessage append( std::string_view sender, std::string_view content, int64_t timestamp )
+    {
+        replay( sender, content, timestamp );
+        const auto& chunk = *chunks_.back();
+        return get( chunk, nextSeq_ - 1 );
+    }
+
+    // Lets an empty store continue the seqs of history that is gone, e.g. trimmed before a checkpoint
+    void startAt( uint64_t seq )
+    {
+        if ( chunks_.empty() )
+            nextSeq_ = std::max( nextSeq_, seq );
+    }
+
+    // Same as append without handing back a copy, for rebuilding a room from the log
+    void replay( std::string_view sender, std::string_view content, int64_t timestamp )
+    {
+        if ( chunks_.empty() or isFull( *chunks_.back(), content.size() ) )
+            startChunk();
+
+        auto* chunk = reserve( content.size() );
+        chunk->entries[chunk->size] = Entry{ .timestamp = timestamp,
+                                             .sender = intern( sender ),
+                                             .offset = static_cast<uint32_t>( chunk->textSize ),
+                                             .size = static_cast<uint32_t>( content.size() ) };
+        std::copy( content.begin(), content.end(), chunk->text.get() + chunk->textSize );
+
+        const size_t before = chunk->bytes();
+        chunk->size += 1;
+        chunk->textSize += content.size();
+        bytes_ += chunk->bytes() - before;
+        ++messageCount_;
+        ++nextSeq_;
+        trim();
+    }
+
+private:
+    // Only called for sealed chunks, whose entries are final
+    static const std::vector<size_t>& encode( const Chunk& chunk )
+    {
+        std::call_once( chunk.encodeOnce,
+            [&]()
+            {
+                chunk.encodedOffsets.reserve( chunk.size + 1 );
+                for ( size_t i = 0; i < chunk.size; ++i )
+                {
+                    chunk.encodedOffsets.push_back( chunk.encoded.size() );
+                    JsonWriter( chunk.encoded ).write( get( chunk, chunk.firstSeq + i ) );
+                    chunk.encoded += ',';
+                }
+                chunk.encodedOffsets.push_back( chunk.encoded.size() );
+                chunk.encoded.shrink_to_fit();
+            } );
+        return chunk.encodedOffsets;
+    }
+
+    static ChatMessage get( const Chunk& chunk, uint64_t seq )
+    {
+        const auto& entry = chunk.entries[seq - chunk.firstSeq];
+        return ChatMessage{ .seq = seq,
+                            .sender = *entry.sender,
+                            .content = std::string( chunk.text.get() + entry.offset, entry.size ),
+                            .timestamp = entry.timestamp };
+    }
+
+    bool isFull( const Chunk& chunk, size_t contentSize ) const
+    {
+        return chunk.size >= chunkMessages_ or
+               ( chunk.size > 0 and chunk.bytes() + sizeof( Entry ) + contentSize > chunkBytes_ );
+    }
+
+    // Seals the current chunk at its final size and opens the next one
+    void startChunk()
+    {
+        std::shared_ptr<const Chunk> previous;
+        if ( not chunks_.empty() )
+        {
+            auto& last = chunks_.back();
+            last = copyChunk( *last, last->size, last->textSize );
+            previous = last;
+        }
+
+        auto chunk = copyChunk( Chunk{}, 1, MinChunkText );
+        chunk->firstSeq = nextSeq_;
+        chunk->senders = std::make_shared<Senders>();
+        senderIds_.clear();
+        chunk->previous.store( std::move( previous ) );
+        chunks_.push_back( std::move( chunk ) );
+    }
+
+    // Room for one more message in the newest chunk, growing it by a copy when needed
+    Chunk* reserve( size_t contentSize )
+    {
+        auto& chunk = chunks_.back();
+        if ( chunk->size == chunk->capacity or chunk->textSize + contentSize > chunk->textCapacity )
+        {
+            const size_t capacity = chunk->size == chunk->capacity ? chunk->capacity * 2 : chunk->capacity;
+            const size_t textCapacity = std::max( chunk->textCapacity * 2, chunk->textSize + contentSize );
+            chunk = copyChunk( *chunk, std::min( capacity, chunkMessages_ ), textCapacity );
+        }
+        return chunk.get();
+    }
+
+    static std::shared_ptr<Chunk> copyChunk( const Chunk& chunk, size_t capacity, size_t textCapacity )
+    {
+        auto copy = std::make_shared<Chunk>();
+        copy->firstSeq = chunk.firstSeq;
+        copy->capacity = capacity;
+        copy->textCapacity = textCapacity;
+        copy->size = chunk.size;
+        copy->textSize = chunk.textSize;
+        copy->entries = std::make_unique_for_overwrite<Entry[]>( capacity );
+        copy->text = std::make_unique_for_overwrite<char[]>( textCapacity );
+        std::copy_n( chunk.entries.get(), chunk.size, copy->entries.get() );
+        std::copy_n( chunk.text.get(), chunk.textSize, copy->text.get() );
+        copy->senders = chunk.senders;
+        copy->previous.store( chunk.previous.load() );
+        return copy;
+    }
+
+    // Drops the oldest chunks while over a limit, the chunk being filled is always kept
+    void trim()
+    {
+        bool trimmed = false;
+        while ( chunks_.size() > 1 and
+                ( ( retention_.maxMessages and messageCount_ > retention_.maxMessages ) or
+                  ( retention_.maxBytes and bytes_ > retention_.maxBytes ) ) )
+        {
+            const auto& oldest = chunks_.front();
+            if ( evict_ )
+            {
+                Range range;
+                range.parts_.push_back( Range::Part{ oldest, oldest->firstSeq, oldest->firstSeq + oldest->size } );
+                    range.from_ = oldest->firstSeq;
+                range.to_ = oldest->firstSeq + oldest->size;
+                evict_( std::move( range ) );
+            }
+            messageCount_ -= oldest->size;
+            bytes_ -= oldest->bytes();
+            chunks_.pop_front();
+            trimmed = true;
+        }
+        if ( trimmed )
+            chunks_.front()->previous.store( nullptr );
+    }
+
+    // Into the newest chunk, whose senders only the owner adds to
+    const std::string* intern( std::string_view sender )
+    {
+        auto it = senderIds_.find( sender );
+        if ( it != senderIds_.end() )
+            return it->second;
+
+        const auto& name = chunks_.back()->senders->emplace_back( sender );
+        senderIds_.emplace( name, &name );
+        return &name;
+    }
+};
@@ -0,0 +1,55 @@
+#pragma once
+#include "common/message.hpp"
+#include <array>
+
+// Immutable, ref-counted frame shared by every session it is sent to
+using SharedBuffer = std::shared_ptr<const std::string>;
+
+// Server message encoded lazily, at most once per wire format, whatever the number of recipients
+class OutboundMessage
+{
+    static constexpr size_t FormatCount = magic_enum::enum_count<WireFormat>();
+
+    mutable std::array<std::once_flag, FormatCount> encodeOnce_;
+    mutable std::array<SharedBuffer, FormatCount> encoded_;
+
+public:
+    OutboundMessage() = default;
+    virtual ~OutboundMessage() = default;
+
+    const SharedBuffer& encode( WireFormat format ) const
+    {
+        const auto index = static_cast<size_t>( format );
+        std::call_once( encodeOnce_[index],
+            [&]() { encoded_[index] = std::make_shared<const std::string>( encodeAs( format ) ); } );
+        return encoded_[index];
+    }
+
+protected:
+    virtual std::string encodeAs( WireFormat format ) const = 0;
+};
+
+template <typename T>
+class TypedOutboundMessage final : public OutboundMessage
+{
+    Message<T> message_;
+
+public:
+    explicit TypedOutboundMessage( Message<T> message )
+        : message_( std::move( message ) )
+    {}
+
+protected:
+    std::string encodeAs( WireFormat format ) const override
+    {
+        return encodeMessage( message_, format );
+    }
+};
+
+using SharedMessage = std::shared_ptr<const OutboundMessage>;
+
+template <typename E, typename T>
+SharedMessage makeSharedMessage( E type, T data )
+{
+    return std::make_shared<const TypedOutboundMessage<T>>( wrapMessage( type, std::move( data ) ) );
+}
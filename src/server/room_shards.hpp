@@ -0,0 +1,50 @@
+#pragma once
+#include "common/helpers.hpp"
+
+// Per-room state split into shards, each owned by its own strand. A room always hashes to
+// the same shard, so work on rooms of different shards never waits on a shared strand.
+template <typename State>
+class RoomShards
+{
+public:
+    struct Shard
+    {
+        asio::strand<asio::io_context::executor_type> strand;
+        State state;  // Only written on strand
+    };
+
+private:
+    std::vector<std::unique_ptr<Shard>> shards_;
+
+public:
+    RoomShards( asio::io_context& ioContext, size_t count )
+    {
+        shards_.reserve( std::max<size_t>( count, 1 ) );
+        for ( size_t i = 0; i < std::max<size_t>( count, 1 ); ++i )
+            shards_.push_back( std::make_unique<Shard>( asio::make_strand( ioContext ) ) );
+    }
+
+    Shard& get( std::string_view room )
+    {
+        return *shards_[std::hash<std::string_view>{}( room ) % shards_.size()];
+    }
+
+    const Shard& get( std::string_view room ) const
+    {
+        return *shards_[std::hash<std::string_view>{}( room ) % shards_.size()];
+    }
+
+    template <typename Function>
+    void forEach( Function fn ) const
+    {
+        for ( const auto& shard : shards_ )
+            fn( *shard );
+    }
+
+    template <typename Function>
+    void forEach( Function fn )
+    {
+        for ( auto& shard : shards_ )
+            fn( *shard );
+    }
+};
@@ -16,11 +16,23 @@ void Server::run()
                 ioContext_.stop();
             } );
 
-        asio::co_spawn( ioContext_, startListener( address_, port_ ), asio::detached );
+        for ( int i = 0; i < listeners_; ++i )
+            asio::co_spawn( ioContext_, startListener( address_, port_, listeners_ > 1 ), asio::detached );
+
+        // The calling thread is one of the workers
+        std::cout << "Info: Running with " << threads_ << " threads on " << getBackend() << "\n";
+        std::vector<std::thread> workers;
+        workers.reserve( threads_ - 1 );
+        for ( int i = 1; i < threads_; ++i )
+            workers.emplace_back( [this]() { ioContext_.run(); } );
 
         ioContext_.run();
+        for ( auto& worker : workers )
+            worker.join();
 
         std::cout << "Server stopped.\n";
+        backpressureStats_.print( std::cout );
+        writeStats_.print( std::cout );
     }
     catch ( const std::exception& e )
     {
@@ -28,7 +40,7 @@ void Server::run()
     }
 }
 
-awaitable<void> Server::startListener( std::string_view address, const int port )
+awaitable<void> Server::startListener( std::string_view address, const int port, const bool reusePort )
 {
     try
     {
@@ -39,22 +51,31 @@ awaitable<void> Server::startListener( std::string_view address, const int port
         tcp::acceptor acceptor( executor );
         acceptor.open( endpoint.protocol() );
         acceptor.set_option( asio::socket_base::reuse_address( true ) );
+#ifdef SO_REUSEPORT
+        // Lets the kernel spread incoming connections over all listeners
+        if ( reusePort )
+            acceptor.set_option( asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>( true ) );
+#else
+        if ( reusePort )
+            std::cerr << "Warning: SO_REUSEPORT is not supported on this platform\n";
+#endif
         acceptor.bind( endpoint );
         acceptor.listen( asio::socket_base::max_listen_connections );
 
         for ( ;; )
         {
-            auto socket = co_await acceptor.async_accept( asio::use_awaitable );
+            // Every session runs on its own strand, so its loops never race across threads
+            auto socket = co_await acceptor.async_accept( asio::make_strand( ioContext_ ), asio::use_awaitable );
+            auto sessionExecutor = socket.get_executor();
 
             // Create new session
             size_t sessionId = nextSessionId_++;
             auto session = std::make_shared<Session>( *this, sessionId, std::move( socket ) );
-            co_await addSession( sessionId, session );
 
             std::cout << "Info: New session created: " << sessionId << "\n";
 
-            // Start session in its own coroutine
-            asio::co_spawn( executor, session->start(), asio::detached );
+            // Start session in its own coroutine, which keeps it alive until the handshake registers it
+            asio::co_spawn( sessionExecutor, [session]() { return session->start(); }, asio::detached );
         }
     }
     catch ( const boost::system::system_error& se )
@@ -66,80 +87,82 @@ awaitable<void> Server::startListener( std::string_view address, const int port
     co_return;
 }
 
-awaitable<void> Server::broadcast( const std::string& message )
+std::string_view Server::getBackend()
 {
-    const auto sessionsCopy = co_await getSessions();
-    co_await sendToSessions( sessionsCopy, message );
+#if defined( BOOST_ASIO_HAS_IO_URING ) and defined( BOOST_ASIO_DISABLE_EPOLL )
+    return "io_uring";
+#elif defined( BOOST_ASIO_HAS_EPOLL )
+    return "epoll";
+#else
+    return "the default reactor";
+#endif
 }
 
-awaitable<void> Server::broadcastExcept( const size_t excludeId,
-                                         const std::string& message )
+void Server::broadcast( const SharedMessage& message )
+{
+    sendToSessions( *getSessions(), message );
+}
+
+void Server::broadcastExcept( const size_t excludeId, const SharedMessage& message )
 {
-    const auto sessionsCopy = co_await getSessions();
     const auto filterClause = [excludeId]( const auto& session ) { return session->getSessionId() != excludeId; };
-    auto filteredSessionsCopy = sessionsCopy | std::views::filter( filterClause );
-    co_await sendToSessions( filteredSessionsCopy, message );
+    sendToSessions( *getSessions() | std::views::filter( filterClause ), message );
 }
 
-awaitable<void> Server::sendToSession( const size_t sessionId, const std::string& message )
+void Server::broadcastToRoom( const std::string& room, const SharedMessage& message )
 {
-    auto session = co_await findSession( sessionId );
-    if ( not session )
-        co_return;
-        
-    auto sessions = { session };
-    co_await sendToSessions( sessions, message );
+    const auto subscribers = getRoomSessions( room );
+    if ( subscribers )
+        sendToSessions( *subscribers, message );
 }
 
-awaitable<void> Server::addSession( const size_t sessionId, std::shared_ptr<Session> session )
+void Server::sendToSession( const size_t sessionId, const SharedMessage& message )
 {
-    co_await asio::post( asio::bind_executor( sessionStrand_, asio::use_awaitable ) );
+    auto session = findSession( sessionId );
+    if ( session )
+        session->send( message );
+}
 
-    sessions_.emplace( sessionId, std::move( session ) );
+awaitable<void> Server::addSession( const size_t sessionId, std::shared_ptr<Session> session )
+{
+    co_await sessionRegistry_.add( sessionId, std::move( session ) );
 }
 
 void Server::removeSession( size_t sessionId )
 {
-    asio::post( sessionStrand_,
-        [this, sessionId]()
-        {
-            auto it = sessions_.find( sessionId );
-            if ( it != sessions_.end() )
-            {
-                std::cout << "Info: Removing session " << sessionId << "\n";
-                sessions_.erase( it );
-            }
-        } );
+    sessionRegistry_.remove( sessionId );
 }
 
-awaitable<std::vector<std::shared_ptr<Session>>> Server::getSessions() const
+std::shared_ptr<const SessionRegistry::SessionList> Server::getSessions() const
 {
-    co_await asio::post( asio::bind_executor( sessionStrand_, asio::use_awaitable ) );
+    return sessionRegistry_.load()->sessionList;
+}
 
-    std::vector<std::shared_ptr<Session>> result;
-    result.reserve( sessions_.size() );
-    for ( const auto& [id, session] : sessions_ )
-        result.push_back( session );
-    co_return result;
+std::shared_ptr<Session> Server::findSession( const size_t sessionId ) const
+{
+    return sessionRegistry_.find( sessionId );
 }
 
-awaitable<std::shared_ptr<Session>> Server::findSession( const size_t sessionId ) const
+awaitable<void> Server::subscribe( const size_t sessionId, const std::string& room )
 {
-    co_await asio::post( asio::bind_executor( sessionStrand_, asio::use_awaitable ) );
+    co_await sessionRegistry_.subscribe( sessionId, room );
+}
 
-    auto it = sessions_.find( sessionId );
-    if ( it != sessions_.end() )
-        co_return it->second;
-    co_return nullptr;
+awaitable<void> Server::unsubscribe( const size_t sessionId, const std::string& room )
+{
+    co_await sessionRegistry_.unsubscribe( sessionId, room );
+}
+
+std::shared_ptr<const SessionRegistry::SessionList> Server::getRoomSessions( const std::string& room ) const
+{
+    return sessionRegistry_.getRoomSessions( room );
 }
 
 void Server::closeAllSessions()
 {
-    asio::post( sessionStrand_,
-        [this]()
-        {
-            for ( auto& [id, session] : sessions_ )
-                session->close();
-            sessions_.clear();
-        } );
+    // Held for the loop, a range-for over *getSessions() would free the list right away
+    const auto sessions = getSessions();
+    for ( const auto& session : *sessions )
+        session->close();
+    sessionRegistry_.clear();
 }
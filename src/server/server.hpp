@@ -1,28 +1,42 @@
 #pragma once
+#include "common/compression.hpp"
 #include "common/helpers.hpp"
 #include "common/message.hpp"
 #include "common/message_dispatcher.hpp"
+#include "common/request_datamodel.hpp"
 #include "session.hpp"
+#include "session_registry.hpp"
 
 class Server
 {
 private:
-    std::string_view address_;
+    std::string address_;
     int port_;
+    int threads_;
+    int listeners_;
     asio::io_context ioContext_;
-    asio::strand<asio::io_context::executor_type> sessionStrand_;
-    std::unordered_map<size_t, std::shared_ptr<Session>> sessions_;
+    SessionRegistry sessionRegistry_;
     std::atomic<size_t> nextSessionId_{ 0 };
-    MessageDispatcher messageDispatcher_;
+    SessionOptions sessionOptions_;
+    CompressionOptions compressionOptions_;
+    BackpressureStats backpressureStats_;
+    WriteStats writeStats_;
+    MessageDispatcher<ClientMessageType> messageDispatcher_;
 
 public:
-    Server( std::string_view address,
+    // With more than one listener every acceptor binds the port through SO_REUSEPORT.
+    // Room subscriptions are split into roomShards shards, one per thread by default.
+    Server( std::string address,
             int port,
-            int threads = 1 )
-        : ioContext_( threads ),
-          sessionStrand_( asio::make_strand( ioContext_ ) ),
-          address_( address ),
-          port_( port )
+            int threads = 1,
+            int listeners = 1,
+            size_t roomShards = 0 )
+        : address_( std::move( address ) ),
+          port_( port ),
+          threads_( std::max( threads, 1 ) ),
+          listeners_( std::max( listeners, 1 ) ),
+          ioContext_( threads_ ),
+          sessionRegistry_( ioContext_, roomShards ? roomShards : static_cast<size_t>( threads_ ) )
     {}
 
     asio::io_context& getIOContext()
@@ -30,45 +44,79 @@ public:
         return ioContext_;
     }
 
+    void setSessionOptions( const SessionOptions& options )
+    {
+        sessionOptions_ = options;
+    }
+
+    const SessionOptions& getSessionOptions() const
+    {
+        return sessionOptions_;
+    }
+
+    void setCompressionOptions( const CompressionOptions& options )
+    {
+        compressionOptions_ = options;
+    }
+
+    const CompressionOptions& getCompressionOptions() const
+    {
+        return compressionOptions_;
+    }
+
+    BackpressureStats& getBackpressureStats()
+    {
+        return backpressureStats_;
+    }
+
+    WriteStats& getWriteStats()
+    {
+        return writeStats_;
+    }
+
+    // Reactor serving the sockets, chosen at build time (CHAT_IO_URING)
+    static std::string_view getBackend();
+
     void run();
-    awaitable<void> startListener( std::string_view address, const int port );
+    awaitable<void> startListener( std::string_view address, const int port, const bool reusePort );
 
     awaitable<void> addSession( const size_t sessionId, std::shared_ptr<Session> session );
-    awaitable<std::vector<std::shared_ptr<Session>>> getSessions() const;
-    awaitable<std::shared_ptr<Session>> findSession( const size_t sessionId ) const;
+    std::shared_ptr<const SessionRegistry::SessionList> getSessions() const;
+    std::shared_ptr<Session> findSession( const size_t sessionId ) const;
     void removeSession( size_t sessionId );
     void closeAllSessions();
 
-    template <typename EnumType, typename ControllerType>
-    void addController( EnumType type, ControllerType&& controller )
+    awaitable<void> subscribe( const size_t sessionId, const std::string& room );
+    awaitable<void> unsubscribe( const size_t sessionId, const std::string& room );
+    std::shared_ptr<const SessionRegistry::SessionList> getRoomSessions( const std::string& room ) const;
+
+    template <typename ControllerType>
+    void addController( ClientMessageType type, ControllerType&& controller )
     {
         messageDispatcher_.addController( type, std::forward<ControllerType>( controller ) );
     }
 
-    awaitable<void> dispatch( const size_t sessionId, const json& message )
+    std::optional<InboundRequest> decodeRequest( std::string_view frame, WireFormat format ) const
+    {
+        return messageDispatcher_.decode( frame, format );
+    }
+
+    awaitable<void> dispatch( const size_t sessionId, const InboundRequest& request ) const
     {
-        co_await messageDispatcher_.dispatch( sessionId, message );
+        return messageDispatcher_.dispatch( sessionId, request );
     }
 
-    awaitable<void> broadcast( const std::string& message );
-    awaitable<void> broadcastExcept( const size_t excludeId, const std::string& message );
-    awaitable<void> sendToSession( const size_t sessionId, const std::string& message );
+    void broadcast( const SharedMessage& message );
+    void broadcastExcept( const size_t excludeId, const SharedMessage& message );
+    void broadcastToRoom( const std::string& room, const SharedMessage& message );
+    void sendToSession( const size_t sessionId, const SharedMessage& message );
 
+    // Only enqueues the frame, every session's writer drains its own queue
     template <std::ranges::input_range Range>
         requires std::same_as<std::ranges::range_value_t<Range>, std::shared_ptr<Session>>
-    awaitable<void> sendToSessions( Range&& sessions, const std::string& message )
+    void sendToSessions( Range&& sessions, const SharedMessage& message )
     {
         for ( auto& session : sessions )
-        {
-            try
-            {
-                co_await session->send( message );
-            }
-            catch ( ... )
-            {
-                session->close();
-                removeSession( session->getSessionId() );
-            }
-        }
+            session->send( message );
     }
 };
@@ -4,66 +4,120 @@
 #include "common/request_datamodel.hpp"
 #include "common/response_datamodel.hpp"
 #include "database.hpp"
+#include "message_batcher.hpp"
 #include "server.hpp"
 
-class OnInitSessionController : public IController
+// Server-side caps on how much history a single response carries
+struct HistoryOptions
+{
+    size_t initialMessages = 50;  // Per room in InitSession and JoinRoom, also caps a resync delta
+    size_t maxPageSize = 200;     // Per FetchHistory page
+    size_t streamChunk = 100;     // Messages per RoomHistory frame of an InitSession stream
+};
+
+class OnInitSessionController final : public IController<InitSessionRequest>
 {
     Database& database_;
     Server& server_;
+    HistoryOptions options_;
 
 public:
-    OnInitSessionController( Server& server, Database& database )
+    OnInitSessionController( Server& server, Database& database, const HistoryOptions& options )
         : database_( database ),
-          server_( server )
+          server_( server ),
+          options_( options )
     {}
     ~OnInitSessionController() override = default;
 
-    awaitable<void> call( const size_t sessionId, const json& /*msg*/ ) override
+    // Streams room by room, each frame waiting for room in the session's queue,
+    // so neither side ever holds more than a few frames of history
+    awaitable<void> call( const size_t sessionId, const InitSessionRequest& request ) override
     {
         std::cout << "Info: OnInitSessionController called for session " << sessionId << "\n";
 
-        auto roomsMessages = co_await database_.getRooms();
-        InitSessionResponse response{ .roomsMessages = std::move( roomsMessages ) };
-        auto message = makeMessage( ServerMessageType::InitSessionResponse, response );
-        co_await server_.sendToSession( sessionId, message );
+        const auto rooms = database_.getRoomNames();
+        InitSessionResponse response{ .serverId = database_.getInstanceId(), .rooms = rooms };
+        if ( not co_await sendPaced( sessionId, makeSharedMessage( ServerMessageType::InitSessionResponse, std::move( response ) ) ) )
+            co_return;
+
+        // Seqs of another history (e.g. before a restart without a log) say nothing about this one
+        const bool sameHistory = request.serverId == database_.getInstanceId();
+        for ( const auto& room : rooms )
+        {
+            auto it = request.since.find( room );
+            const uint64_t since = sameHistory and it != request.since.end() ? it->second : 0;
+            const auto page = co_await database_.getRoomDelta( room, since, options_.initialMessages );
+
+            auto pieces = splitPage( page, options_.streamChunk );
+            for ( auto& piece : pieces )
+            {
+                if ( not co_await sendPaced( sessionId, makeSharedMessage( ServerMessageType::RoomHistory, std::move( piece ) ) ) )
+                    co_return;
+            }
+        }
+    }
+
+private:
+    // Looked up for every frame, false once the session is gone
+    awaitable<bool> sendPaced( const size_t sessionId, const SharedMessage& message )
+    {
+        auto session = server_.findSession( sessionId );
+        if ( not session )
+            co_return false;
+        co_await session->sendPaced( message );
+        co_return true;
+    }
+
+    // Consecutive pieces of at most chunk messages; an empty page stays one piece
+    static std::vector<HistoryPageView> splitPage( const HistoryPageView& page, size_t chunk )
+    {
+        const auto& range = page.messages;
+        std::vector<HistoryPageView> pieces;
+        uint64_t from = range.from();
+        do
+        {
+            const uint64_t to = std::min( range.to(), from + std::max<size_t>( chunk, 1 ) );
+            pieces.push_back( HistoryPageView{ .room = page.room,
+                                               .messages = range.slice( from, to ),
+                                               .cursor = from,
+                                               .hasMore = page.hasMore or from > page.cursor } );
+            from = to;
+        } while ( from < range.to() );
+        return pieces;
     }
 };
 
 
-class OnNewMessageController : public IController
+class OnNewMessageController final : public IController<PostMessageRequest>
 {
     Database& database_;
-    Server& server_;
+    MessageBatcher& batcher_;
 
 public:
-    OnNewMessageController( Server& server, Database& database )
+    OnNewMessageController( MessageBatcher& batcher, Database& database )
         : database_( database ),
-          server_( server )
+          batcher_( batcher )
     {}
     ~OnNewMessageController() override = default;
 
-    awaitable<void> call( const size_t sessionId, const json& msg ) override
+    awaitable<void> call( const size_t sessionId, const PostMessageRequest& request ) override
     {
         std::cout << "Info: OnNewMessageController called for session " << sessionId << "\n";
 
-        auto request = msg.get<PostMessageRequest>();
         ChatMessage chatMessage{ .sender = request.user,
                                  .content = request.message,
                                  .timestamp = getTimestamp() };
 
-        co_await database_.addMessage( request.room, std::move( chatMessage ) );
+        auto stored = co_await database_.addMessage( request.room, std::move( chatMessage ) );
+        if ( not stored )
+            co_return;
 
-        NewMessage response{
-            .room = request.room,
-            .chatMessage = chatMessage
-        };
-        const auto message = makeMessage( ServerMessageType::NewMessage, response );
-        co_await server_.broadcast( message );
+        batcher_.broadcast( request.room, std::move( stored.value() ) );
     }
 };
 
 
-class OnNewRoomController : public IController
+class OnNewRoomController final : public IController<PostRoomRequest>
 {
     Database& database_;
     Server& server_;
@@ -75,15 +129,95 @@ public:
     {}
     ~OnNewRoomController() override = default;
 
-    awaitable<void> call( const size_t sessionId, const json& msg ) override
+    awaitable<void> call( const size_t sessionId, const PostRoomRequest& request ) override
     {
         std::cout << "Info: OnNewRoomController called for session " << sessionId << "\n";
         
-        auto request = msg.get<PostRoomRequest>();
         co_await database_.addRoom( request.room );
 
         NewRoom response{ .room = request.room };
-        auto message = makeMessage( ServerMessageType::NewRoom, response );
-        co_await server_.broadcast( message );
+        auto message = makeSharedMessage( ServerMessageType::NewRoom, std::move( response ) );
+        server_.broadcast( message );
+    }
+};
+
+
+class OnJoinRoomController final : public IController<JoinRoomRequest>
+{
+    Database& database_;
+    Server& server_;
+    HistoryOptions options_;
+
+public:
+    OnJoinRoomController( Server& server, Database& database, const HistoryOptions& options )
+        : database_( database ),
+          server_( server ),
+          options_( options )
+    {}
+    ~OnJoinRoomController() override = default;
+
+    awaitable<void> call( const size_t sessionId, const JoinRoomRequest& request ) override
+    {
+        std::cout << "Info: OnJoinRoomController called for session " << sessionId << "\n";
+
+        // Unknown rooms get no subscription, it would never be fed or cleaned up
+        if ( not database_.hasRoom( request.room ) )
+        {
+            std::cerr << "Error: Session " << sessionId << " joined unknown room " << request.room << "\n";
+            co_return;
+        }
+
+        // Subscribe first so no message posted while the history is read gets lost
+        co_await server_.subscribe( sessionId, request.room );
+
+        const uint64_t since = request.serverId == database_.getInstanceId() ? request.since : 0;
+        auto response = co_await database_.getRoomDelta( request.room, since, options_.initialMessages );
+        auto message = makeSharedMessage( ServerMessageType::RoomHistory, std::move( response ) );
+        server_.sendToSession( sessionId, message );
+    }
+};
+
+
+class OnLeaveRoomController final : public IController<LeaveRoomRequest>
+{
+    Server& server_;
+
+public:
+    OnLeaveRoomController( Server& server )
+        : server_( server )
+    {}
+    ~OnLeaveRoomController() override = default;
+
+    awaitable<void> call( const size_t sessionId, const LeaveRoomRequest& request ) override
+    {
+        std::cout << "Info: OnLeaveRoomController called for session " << sessionId << "\n";
+
+        co_await server_.unsubscribe( sessionId, request.room );
+    }
+};
+
+
+class OnFetchHistoryController final : public IController<FetchHistoryRequest>
+{
+    Database& database_;
+    Server& server_;
+    HistoryOptions options_;
+
+public:
+    OnFetchHistoryController( Server& server, Database& database, const HistoryOptions& options )
+        : database_( database ),
+          server_( server ),
+          options_( options )
+    {}
+    ~OnFetchHistoryController() override = default;
+
+    awaitable<void> call( const size_t sessionId, const FetchHistoryRequest& request ) override
+    {
+        std::cout << "Info: OnFetchHistoryController called for session " << sessionId << "\n";
+
+        const size_t limit = std::min<uint64_t>( request.limit, options_.maxPageSize );
+        auto response = co_await database_.getRoomPage( request.room, request.before, limit );
+        auto message = makeSharedMessage( ServerMessageType::HistoryPage, std::move( response ) );
+        server_.sendToSession( sessionId, message );
     }
 };
\ No newline at end of file
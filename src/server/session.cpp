@@ -1,14 +1,21 @@
 #include "pch.hpp"
 #include "common/helpers.hpp"
+#include "common/message.hpp"
+#include "common/response_datamodel.hpp"
 #include "server.hpp"
 #include "session.hpp"
+#include <unordered_set>
 
 Session::Session( Server& server, size_t id, tcp::socket socket )
     : server_( server ), 
       sessionId_( id ),
-      webSocket_( std::move( socket ) )
+      webSocket_( std::move( socket ) ),
+      writeSignal_( webSocket_.get_executor() ),
+      readSignal_( webSocket_.get_executor() )
 {
     webSocket_.text( true );
+    // Each frame in one piece, beast would otherwise split large ones into a write per 4 KiB
+    webSocket_.auto_fragment( false );
 }
 
 size_t Session::getSessionId() const
@@ -18,17 +25,33 @@ size_t Session::getSessionId() const
 
 awaitable<void> Session::start()
 {
+    auto self = shared_from_this();
     try
     {
         // Set timeout and server decorator
         webSocket_.set_option( websocket::stream_base::timeout::suggested( beast::role_type::server ) );
+        webSocket_.set_option( server_.getCompressionOptions().toOption( beast::role_type::server ) );
 
         // Accept the websocket handshake
-        co_await webSocket_.async_accept( asio::use_awaitable );
-        std::cout << "Info: Session " << sessionId_ << " connected\n";
+        co_await acceptHandshake();
+        std::cout << "Info: Session " << sessionId_ << " connected ("
+                  << magic_enum::enum_name( wireFormat_ ) << ")\n";
+
+        // Only registered once the wire format is known, so no frame is encoded before that
+        co_await server_.addSession( sessionId_, self );
+
+        // Outbound frames are written by a dedicated coroutine
+        asio::co_spawn( webSocket_.get_executor(), writeLoop(), asio::detached );
+
+        // Requests are processed by workers, so reading goes on while earlier ones broadcast
+        for ( size_t i = 0; i < std::max<size_t>( server_.getSessionOptions().inboundWorkers, 1 ); ++i )
+            asio::co_spawn( webSocket_.get_executor(), processLoop(), asio::detached );
 
         // Start reading messages
         co_await readLoop();
+
+        // A client may close right after its last requests, they are still processed
+        co_await drainRequests();
     }
     catch ( const boost::system::system_error& se )
     {
@@ -40,29 +63,152 @@ awaitable<void> Session::start()
     }
 
     // Clean up when session ends
+    stopQueues();
     removeFromServer();
 }
 
-awaitable<void> Session::send( const std::string& message )
+void Session::send( const SharedMessage& message )
 {
-    try
-    {
-        co_await webSocket_.async_write( asio::buffer( message ), asio::use_awaitable );
-    }
-    catch ( const boost::system::system_error& se )
+    asio::post( webSocket_.get_executor(),
+        [self = shared_from_this(), message]()
+        {
+            self->enqueue( message->encode( self->wireFormat_ ) );
+        } );
+}
+
+// For producers of many frames (e.g. history streaming): instead of overflowing the queue,
+// waits until the frame fits into it, so the stream is paced by the socket. The overflow
+// policy never applies, a frame larger than the limits goes out alone once the queue is empty.
+// Must be awaited on the session's strand, as controllers are
+awaitable<void> Session::sendPaced( const SharedMessage& message )
+{
+    auto self = shared_from_this();
+    auto buffer = message->encode( wireFormat_ );
+    while ( not isClosing_ and not writeQueue_.empty() and exceedsLimits( buffer->size() ) )
+        co_await drainWaiters_.wait();
+    if ( not isClosing_ )
+        push( std::move( buffer ) );
+}
+
+void Session::enqueue( SharedBuffer message )
+{
+    if ( isClosing_ )
+        return;
+
+    if ( exceedsLimits( message->size() ) )
     {
-        std::cerr << "Send error in session " << sessionId_ << ": "
-                  << formatWebSocketError( se.code() ) << "\n";
-        throw;
+        auto& stats = server_.getBackpressureStats();
+        switch ( server_.getSessionOptions().overflowPolicy )
+        {
+            case OverflowPolicy::DropOldest:
+            {
+                // A single oversized frame is still let through once the queue is empty
+                while ( not writeQueue_.empty() and exceedsLimits( message->size() ) )
+                {
+                    queuedBytes_ -= writeQueue_.front()->size();
+                    writeQueue_.pop_front();
+                    ++stats.droppedOldest;
+                }
+                break;
+            }
+            case OverflowPolicy::DropNew:
+            {
+                ++stats.droppedNew;
+                return;
+            }
+            case OverflowPolicy::Coalesce:
+            {
+                // The client refetches its state, which covers everything dropped here
+                writeQueue_.clear();
+                message = makeSharedMessage( ServerMessageType::ResyncRequired, json() )->encode( wireFormat_ );
+                queuedBytes_ = 0;
+                ++stats.coalesced;
+                break;
+            }
+            case OverflowPolicy::Disconnect:
+            {
+                std::cout << "Info: Disconnecting slow session " << sessionId_ << "\n";
+                ++stats.disconnected;
+                abort();
+                return;
+            }
+        }
     }
+
+    push( std::move( message ) );
+}
+
+void Session::push( SharedBuffer message )
+{
+    queuedBytes_ += message->size();
+    writeQueue_.push_back( std::move( message ) );
+    writeSignal_.cancel_one();
+}
+
+bool Session::exceedsLimits( size_t extraBytes ) const
+{
+    const auto& options = server_.getSessionOptions();
+    return writeQueue_.size() + 1 > options.maxQueuedMessages or
+           queuedBytes_ + extraBytes > options.maxQueuedBytes;
 }
 
 void Session::close()
 {
+    asio::post( webSocket_.get_executor(),
+        [self = shared_from_this()]()
+        {
+            self->stopQueues();
+            // The peer may have closed it first
+            if ( not self->webSocket_.is_open() )
+                return;
+
+            beast::error_code ec;
+            self->webSocket_.close( websocket::close_code::normal, ec );
+            if ( ec )
+                std::cerr << "Close error: " << ec.message() << "\n";
+        } );
+}
+
+void Session::abort()
+{
+    stopQueues();
+
+    // Skip the closing handshake, a stalled peer would never complete it
     beast::error_code ec;
-    webSocket_.close( websocket::close_code::normal, ec );
-    if ( ec )
-        std::cerr << "Close error: " << ec.message() << "\n";
+    auto& socket = beast::get_lowest_layer( webSocket_ );
+    socket.shutdown( tcp::socket::shutdown_both, ec );
+    socket.close( ec );
+}
+
+awaitable<void> Session::acceptHandshake()
+{
+    // Read the upgrade request ourselves to pick the wire format from the offered subprotocols.
+    // The websocket's handshake timeout only covers async_accept, so the read gets a deadline of its own
+    asio::steady_timer deadline( webSocket_.get_executor(), HandshakeTimeout );
+    deadline.async_wait(
+        [self = shared_from_this()]( boost::system::error_code ec )
+        {
+            if ( ec )
+                return;
+            std::cout << "Info: Session " << self->sessionId_ << " timed out before its handshake\n";
+            self->abort();
+        } );
+    http::request<http::string_body> request;
+    co_await http::async_read( webSocket_.next_layer(), buffer_, request, asio::use_awaitable );
+    deadline.cancel();
+
+    const auto offered = request[http::field::sec_websocket_protocol];
+    auto format = negotiateWireFormat( std::string_view( offered.data(), offered.size() ) );
+    if ( format )
+    {
+        wireFormat_ = format.value();
+        webSocket_.set_option( websocket::stream_base::decorator(
+            [protocol = std::string( wireFormatProtocol( wireFormat_ ) )]( websocket::response_type& response )
+            { response.set( http::field::sec_websocket_protocol, protocol ); } ) );
+    }
+
+    co_await webSocket_.async_accept( request, asio::use_awaitable );
+    webSocket_.binary( wireFormat_ != WireFormat::Json );
 }
 
 awaitable<void> Session::readLoop()
@@ -74,11 +220,13 @@ awaitable<void> Session::readLoop()
             // Read a message
             co_await webSocket_.async_read( buffer_, asio::use_awaitable );
 
-            // Process message
-            std::string messageText = beast::buffers_to_string( buffer_.data() );
-            co_await handleMessage( std::move( messageText ) );
-
+            // Decoded straight from the read buffer, which is free for the next frame right after
+            const auto data = buffer_.data();
+            auto request = server_.decodeRequest( std::string_view( static_cast<const char*>( data.data() ), data.size() ), wireFormat_ );
             buffer_.consume( buffer_.size() );
+
+            if ( request )
+                co_await queueRequest( std::move( *request ) );
         }
         catch ( const boost::system::system_error& se )
         {
@@ -90,9 +238,165 @@ awaitable<void> Session::readLoop()
     }
 }
 
-awaitable<void> Session::handleMessage( std::string message )
+awaitable<void> Session::writeLoop()
+{
+    auto self = shared_from_this();
+    try
+    {
+        while ( not isClosing_ )
+        {
+            // Sleep until send() queues a frame or the session stops
+            if ( writeQueue_.empty() )
+            {
+                boost::system::error_code ec;
+                writeSignal_.expires_at( asio::steady_timer::time_point::max() );
+                co_await writeSignal_.async_wait( asio::redirect_error( asio::use_awaitable, ec ) );
+                continue;
+            }
+
+            // Frames queued together go out together: the stream holds back all but the last,
+            // so the burst costs a single socket write
+            const auto batch = takeBatch();
+            auto& stream = webSocket_.next_layer();
+            const uint64_t socketWrites = stream.getSocketWrites();
+            for ( size_t i = 0; i < batch.size() and not isClosing_; ++i )
+            {
+                stream.cork( i + 1 < batch.size() );
+                co_await webSocket_.async_write( asio::buffer( *batch[i] ), asio::use_awaitable );
+            }
+            stream.cork( false );
+
+            auto& stats = server_.getWriteStats();
+            stats.frames += batch.size();
+            stats.socketWrites += stream.getSocketWrites() - socketWrites;
+        }
+    }
+    catch ( const boost::system::system_error& se )
+    {
+        std::cerr << "Send error in session " << sessionId_ << ": "
+                  << formatWebSocketError( se.code() ) << "\n";
+        close();
+        removeFromServer();
+    }
+}
+
+// Takes the oldest frame plus the ones behind it that fit into the coalescing limit
+std::vector<SharedBuffer> Session::takeBatch()
+{
+    const size_t limit = server_.getSessionOptions().maxCoalescedBytes;
+    std::vector<SharedBuffer> batch;
+    size_t bytes = 0;
+    do
+    {
+        bytes += writeQueue_.front()->size();
+        queuedBytes_ -= writeQueue_.front()->size();
+        batch.push_back( std::move( writeQueue_.front() ) );
+        writeQueue_.pop_front();
+    } while ( not writeQueue_.empty() and bytes + writeQueue_.front()->size() <= limit );
+
+    drainWaiters_.notifyAll();
+    return batch;
+}
+
+// Waits while the inbound queue is full, so a client sending faster than its requests
+// are processed is slowed down by TCP flow control instead of growing the queue
+awaitable<void> Session::queueRequest( InboundRequest request )
+{
+    auto self = shared_from_this();
+    while ( not isClosing_ and inbound_.size() >= std::max<size_t>( server_.getSessionOptions().maxInboundMessages, 1 ) )
+    {
+        boost::system::error_code ec;
+        readSignal_.expires_at( asio::steady_timer::time_point::max() );
+        co_await readSignal_.async_wait( asio::redirect_error( asio::use_awaitable, ec ) );
+    }
+    if ( isClosing_ )
+        co_return;
+
+    inbound_.push_back( std::move( request ) );
+    idleWorkers_.notifyOne();
+}
+
+awaitable<void> Session::processLoop()
+{
+    auto self = shared_from_this();
+    while ( not isClosing_ )
+    {
+        auto request = takeRunnable();
+        if ( not request )
+        {
+            // Sleep until a request arrives or a running one releases its key
+            co_await idleWorkers_.wait();
+            continue;
+        }
+        readSignal_.cancel();
+
+        try
+        {
+            co_await server_.dispatch( sessionId_, *request );
+        }
+        catch ( const std::exception& e )
+        {
+            std::cerr << "Session " << sessionId_ << " error: " << e.what() << "\n";
+            abort();
+        }
+
+        running_.erase( std::ranges::find( running_, request->getRoom() ) );
+        idleWorkers_.notifyAll();
+        readSignal_.cancel();
+    }
+}
+
+awaitable<void> Session::drainRequests()
+{
+    auto self = shared_from_this();
+    while ( not isClosing_ and ( not inbound_.empty() or not running_.empty() ) )
+    {
+        boost::system::error_code ec;
+        readSignal_.expires_at( asio::steady_timer::time_point::max() );
+        co_await readSignal_.async_wait( asio::redirect_error( asio::use_awaitable, ec ) );
+    }
+}
+
+// The oldest queued request that may start: its room is neither running nor named by an earlier
+// queued request, and no request without a room is running or queued in front of it
+std::optional<InboundRequest> Session::takeRunnable()
+{
+    if ( std::ranges::any_of( running_, []( const auto& key ) { return not key; } ) )
+        return std::nullopt;
+
+    std::unordered_set<std::string_view> waiting;  // Rooms of earlier requests still queued
+    for ( auto it = inbound_.begin(); it != inbound_.end(); ++it )
+    {
+        const auto& room = it->getRoom();
+        if ( not room )
+        {
+            if ( it != inbound_.begin() or not running_.empty() )
+                return std::nullopt;
+        }
+        else if ( waiting.contains( *room ) or std::ranges::find( running_, room ) != running_.end() )
+        {
+            waiting.insert( *room );
+            continue;
+        }
+
+        auto request = std::move( *it );
+        inbound_.erase( it );
+        running_.push_back( request.getRoom() );
+        return request;
+    }
+    return std::nullopt;
+}
+
+void Session::stopQueues()
 {
-    co_await server_.dispatch( getSessionId(), json::parse( message ) );
+    isClosing_ = true;
+    writeQueue_.clear();
+    queuedBytes_ = 0;
+    inbound_.clear();
+    writeSignal_.cancel();
+    drainWaiters_.notifyAll();
+    idleWorkers_.notifyAll();
+    readSignal_.cancel();
 }
 
 void Session::removeFromServer()
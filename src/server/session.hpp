@@ -1,13 +1,41 @@
 #pragma once
+#include "backpressure.hpp"
+#include "common/helpers.hpp"
+#include "common/message_dispatcher.hpp"
+#include "common/request_datamodel.hpp"
+#include "coalescing_stream.hpp"
+#include "outbound_message.hpp"
+#include <deque>
+#include <optional>
 
 class Server;
 
+using InboundRequest = MessageDispatcher<ClientMessageType>::Request;
+
 class Session : public std::enable_shared_from_this<Session>
 {
+    // Same as the websocket's suggested server handshake timeout
+    static constexpr auto HandshakeTimeout = std::chrono::seconds( 30 );
+
     Server& server_;
     size_t sessionId_;
-    websocket::stream<tcp::socket> webSocket_;
+    websocket::stream<CoalescingStream<tcp::socket>> webSocket_;
     beast::flat_buffer buffer_;
+    WireFormat wireFormat_ = WireFormat::Json;
+
+    // Outbound frames, drained in order by writeLoop; only touched on the session's strand
+    std::deque<SharedBuffer> writeQueue_;
+    size_t queuedBytes_ = 0;
+    asio::steady_timer writeSignal_;
+    WaitList drainWaiters_;  // sendPaced callers, woken once a frame left the queue
+    bool isClosing_ = false;
+
+    // Inbound requests, read ahead while workers process earlier ones; only touched on the session's strand
+    // Requests naming the same room run in order, one naming none waits for all others
+    std::deque<InboundRequest> inbound_;
+    std::vector<std::optional<std::string>> running_;  // Rooms of the requests being processed
+    WaitList idleWorkers_;            // Woken once a request arrived or a key was released
+    asio::steady_timer readSignal_;  // Wakes the reader once the inbound queue has room or a request finished
 
 public:
     Session(Server& server, size_t id, tcp::socket socket);
@@ -15,11 +43,23 @@ public:
 
     size_t getSessionId() const;
     awaitable<void> start();
-    awaitable<void> send(const std::string& message);
+    void send(const SharedMessage& message);
+    awaitable<void> sendPaced(const SharedMessage& message);
     void close();
 
 private:
+    void abort();
+    awaitable<void> acceptHandshake();
     awaitable<void> readLoop();
-    awaitable<void> handleMessage(std::string message);
+    awaitable<void> writeLoop();
+    awaitable<void> processLoop();
+    awaitable<void> queueRequest(InboundRequest request);
+    awaitable<void> drainRequests();
+    std::optional<InboundRequest> takeRunnable();
+    void enqueue(SharedBuffer message);
+    void push(SharedBuffer message);
+    std::vector<SharedBuffer> takeBatch();
+    bool exceedsLimits(size_t extraBytes) const;
+    void stopQueues();
     void removeFromServer();
 };
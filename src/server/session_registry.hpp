@@ -0,0 +1,199 @@
+#pragma once
+#include "common/helpers.hpp"
+#include "room_shards.hpp"
+#include "session.hpp"
+#include <unordered_set>
+
+// Copy-on-write registry of sessions and room subscriptions.
+// Writers rebuild an immutable snapshot on the owning strand, readers only load the latest one.
+// Subscriptions are sharded by room, so joins to rooms of different shards never wait on each other
+// and a join only copies the rooms of its shard.
+class SessionRegistry
+{
+public:
+    using SessionList = std::vector<std::shared_ptr<Session>>;
+    using SessionMap = std::unordered_map<size_t, std::shared_ptr<Session>>;
+    using RoomMap = std::unordered_map<std::string, std::shared_ptr<const SessionList>>;
+
+    // Unchanged parts are shared between consecutive snapshots
+    struct Snapshot
+    {
+        std::shared_ptr<const SessionMap> sessions = std::make_shared<const SessionMap>();
+        std::shared_ptr<const SessionList> sessionList = std::make_shared<const SessionList>();
+    };
+
+private:
+    struct Subscriptions
+    {
+        std::unordered_map<std::string, std::unordered_set<size_t>> subscribers;
+        std::atomic<std::shared_ptr<const RoomMap>> rooms{ std::make_shared<const RoomMap>() };
+    };
+
+    asio::strand<asio::io_context::executor_type> strand_;  // Owns the sessions
+    std::atomic<std::shared_ptr<const Snapshot>> snapshot_;
+    RoomShards<Subscriptions> shards_;
+
+public:
+    SessionRegistry( asio::io_context& ioContext, size_t shards = 1 )
+        : strand_( asio::make_strand( ioContext ) ),
+          snapshot_( std::make_shared<const Snapshot>() ),
+          shards_( ioContext, shards )
+    {}
+
+    std::shared_ptr<const Snapshot> load() const
+    {
+        return snapshot_.load( std::memory_order_acquire );
+    }
+
+    std::shared_ptr<Session> find( const size_t sessionId ) const
+    {
+        const auto snapshot = load();
+        auto it = snapshot->sessions->find( sessionId );
+        if ( it != snapshot->sessions->end() )
+            return it->second;
+        return nullptr;
+    }
+
+    std::shared_ptr<const SessionList> getRoomSessions( const std::string& room ) const
+    {
+        const auto rooms = shards_.get( room ).state.rooms.load( std::memory_order_acquire );
+        auto it = rooms->find( room );
+        if ( it != rooms->end() )
+            return it->second;
+        return nullptr;
+    }
+
+    awaitable<void> add( const size_t sessionId, std::shared_ptr<Session> session )
+    {
+        co_await runOn( strand_,
+            [&]()
+            {
+                auto sessions = std::make_shared<SessionMap>( *load()->sessions );
+                sessions->emplace( sessionId, std::move( session ) );
+                publishSessions( std::move( sessions ) );
+            } );
+    }
+
+    void remove( const size_t sessionId )
+    {
+        asio::post( strand_,
+            [this, sessionId]()
+            {
+                auto current = load();
+                if ( not current->sessions->contains( sessionId ) )
+                    return;
+
+                std::cout << "Info: Removing session " << sessionId << "\n";
+                auto sessions = std::make_shared<SessionMap>( *current->sessions );
+                sessions->erase( sessionId );
+                publishSessions( std::move( sessions ) );
+
+                // A subscribe that still saw the session ran on its shard before this
+                shards_.forEach(
+                    [this, sessionId]( Shard& shard )
+                    {
+                        asio::post( shard.strand,
+                            [this, &shard, sessionId]()
+                            {
+                                auto& subscribers = shard.state.subscribers;
+                                for ( auto it = subscribers.begin(); it != subscribers.end(); )
+                                {
+                                    const auto& room = it->first;
+                                    const bool erased = it->second.erase( sessionId );
+                                    ++it;
+                                    if ( erased )
+                                        publishRoom( shard, room );
+                                }
+                            } );
+                    } );
+            } );
+    }
+
+    awaitable<void> subscribe( const size_t sessionId, const std::string& room )
+    {
+        auto& shard = shards_.get( room );
+        co_await runOn( shard.strand,
+            [&]()
+            {
+                if ( not load()->sessions->contains( sessionId ) )
+                    return;
+                if ( shard.state.subscribers[room].insert( sessionId ).second )
+                    publishRoom( shard, room );
+            } );
+    }
+
+    awaitable<void> unsubscribe( const size_t sessionId, const std::string& room )
+    {
+        auto& shard = shards_.get( room );
+        co_await runOn( shard.strand,
+            [&]()
+            {
+                auto& subscribers = shard.state.subscribers;
+                auto it = subscribers.find( room );
+                if ( it != subscribers.end() and it->second.erase( sessionId ) )
+                    publishRoom( shard, room );
+            } );
+    }
+
+    void clear()
+    {
+        asio::post( strand_, [this]() { snapshot_.store( std::make_shared<const Snapshot>(), std::memory_order_release ); } );
+        shards_.forEach(
+            []( Shard& shard )
+            {
+                asio::post( shard.strand,
+                    [&shard]()
+                    {
+                        shard.state.subscribers.clear();
+                        shard.state.rooms.store( std::make_shared<const RoomMap>(), std::memory_order_release );
+                    } );
+            } );
+    }
+
+private:
+    using Shard = RoomShards<Subscriptions>::Shard;
+
+    // Runs on strand_, the only writer of snapshot_
+    void publishSessions( std::shared_ptr<SessionMap> sessions )
+    {
+        auto sessionList = std::make_shared<SessionList>();
+        sessionList->reserve( sessions->size() );
+        for ( const auto& [_, session] : *sessions )
+            sessionList->push_back( session );
+
+        auto snapshot = std::make_shared<Snapshot>( *load() );
+        snapshot->sessions = std::move( sessions );
+        snapshot->sessionList = std::move( sessionList );
+        snapshot_.store( std::move( snapshot ), std::memory_order_release );
+    }
+
+    // Runs on the shard's strand, the only writer of its rooms
+    void publishRoom( Shard& shard, const std::string& room )
+    {
+        const auto sessions = load()->sessions;
+        auto rooms = std::make_shared<RoomMap>( *shard.state.rooms.load( std::memory_order_acquire ) );
+
+        auto& roomSubscribers = shard.state.subscribers;
+        auto it = roomSubscribers.find( room );
+        if ( it == roomSubscribers.end() or it->second.empty() )
+        {
+            rooms->erase( room );
+            if ( it != roomSubscribers.end() )
+                roomSubscribers.erase( it );
+        }
+        else
+        {
+            auto subscribers = std::make_shared<SessionList>();
+            subscribers->reserve( it->second.size() );
+            for ( const auto sessionId : it->second )
+            {
+                auto sessionIt = sessions->find( sessionId );
+                if ( sessionIt != sessions->end() )
+                    subscribers->push_back( sessionIt->second );
+            }
+            ( *rooms )[room] = std::move( subscribers );
+        }
+
+        shard.state.rooms.store( std::move( rooms ), std::memory_order_release );
+    }
+};